@@ -0,0 +1,28 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+
+
+/* Helpers for the microbenchmarks and accuracy checks, built and run with
+`make bench`. They are not part of the plugin.
+*/
+namespace bench {
+
+// Written with the loop results so the optimizer keeps the loops
+static volatile float sink;
+
+// Best of `runs` calls of f(), in nanoseconds per item when f() handles `items` items
+template <class F>
+double nsPerItem(F f, long items, int runs = 5) {
+	double best = 1e30;
+	for (int r = 0; r < runs; r++) {
+		auto t0 = std::chrono::steady_clock::now();
+		f();
+		auto t1 = std::chrono::steady_clock::now();
+		best = std::min(best, std::chrono::duration<double, std::nano>(t1 - t0).count() / items);
+	}
+	return best;
+}
+
+} // namespace bench
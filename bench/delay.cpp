@@ -0,0 +1,119 @@
+#include "bench.hpp"
+#include "delayline.hpp"
+#include <samplerate.h>
+#include <vector>
+
+
+/* Wobble's delay line against the libsamplerate path it replaced (SINC_FASTEST
+fed by 16 frames, as Wobble did). A sine is read at a constant tape speed, so
+both outputs should be a pure sine at a shifted frequency: THD+N is what a
+least-squares sine fit leaves over, then the cost per sample.
+*/
+static const float SAMPLE_RATE = 48000.f;
+static const int N = 1 << 16;
+// Read position drift in samples per sample, about a fifth of a semitone
+static const double DRIFT = 0.0123;
+// Outputs skipped before the fit, so the resampler has settled
+static const int SETTLE = 4096;
+
+static std::vector<float> sine(double freq) {
+	std::vector<float> x(N);
+	for (int n = 0; n < N; n++)
+		x[n] = std::sin(2.0 * M_PI * freq / SAMPLE_RATE * n);
+	return x;
+}
+
+// Fit a sin + b cos + c at the known frequency, return the residual against the sine in dB
+static double thdN(const std::vector<float>& y, double omega) {
+	double m[3][3] = {}, r[3] = {};
+	for (size_t n = SETTLE; n < y.size(); n++) {
+		double b[3] = {std::sin(omega * n), std::cos(omega * n), 1.0};
+		for (int i = 0; i < 3; i++) {
+			r[i] += b[i] * y[n];
+			for (int j = 0; j < 3; j++)
+				m[i][j] += b[i] * b[j];
+		}
+	}
+	// Cramer's rule
+	auto det = [](double a[3][3]) {
+		return a[0][0] * (a[1][1] * a[2][2] - a[1][2] * a[2][1])
+			- a[0][1] * (a[1][0] * a[2][2] - a[1][2] * a[2][0])
+			+ a[0][2] * (a[1][0] * a[2][1] - a[1][1] * a[2][0]);
+	};
+	double d = det(m);
+	double coef[3];
+	for (int k = 0; k < 3; k++) {
+		double mk[3][3];
+		for (int i = 0; i < 3; i++) {
+			for (int j = 0; j < 3; j++)
+				mk[i][j] = (j == k) ? r[i] : m[i][j];
+		}
+		coef[k] = det(mk) / d;
+	}
+	double residual = 0.0;
+	for (size_t n = SETTLE; n < y.size(); n++) {
+		double e = y[n] - coef[0] * std::sin(omega * n) - coef[1] * std::cos(omega * n) - coef[2];
+		residual += e * e;
+	}
+	double signal = 0.5 * (coef[0] * coef[0] + coef[1] * coef[1]) * (y.size() - SETTLE);
+	return 10.0 * std::log10(residual / signal);
+}
+
+// The delay shrinks at a constant rate, so the input is read DRIFT faster
+static std::vector<float> runDelayLine(const std::vector<float>& x, int interpolation) {
+	static delayline::DelayLine<float, 2048> line;
+	line.reset();
+	std::vector<float> y(N);
+	for (int n = 0; n < N; n++) {
+		line.push(x[n]);
+		y[n] = line.read(1500.f - DRIFT * n, interpolation);
+	}
+	return y;
+}
+
+static std::vector<float> runSrc(const std::vector<float>& x) {
+	SRC_STATE* src = src_new(SRC_SINC_FASTEST, 1, NULL);
+	std::vector<float> y(N);
+	long in = 0, out = 0;
+	while (in < N && out < N) {
+		SRC_DATA srcData;
+		srcData.data_in = &x[in];
+		srcData.data_out = &y[out];
+		srcData.input_frames = std::min(16L, N - in);
+		srcData.output_frames = N - out;
+		srcData.end_of_input = false;
+		srcData.src_ratio = 1.0 / (1.0 + DRIFT);
+		src_process(src, &srcData);
+		in += srcData.input_frames_used;
+		out += srcData.output_frames_gen;
+	}
+	src_delete(src);
+	y.resize(out);
+	return y;
+}
+
+int main() {
+	const char* names[] = {"Hermite", "Lagrange", "windowed sinc"};
+	std::vector<float> low = sine(1000.0);
+	std::vector<float> high = sine(10000.0);
+	double lowOmega = 2.0 * M_PI * 1000.0 / SAMPLE_RATE * (1.0 + DRIFT);
+	double highOmega = 2.0 * M_PI * 10000.0 / SAMPLE_RATE * (1.0 + DRIFT);
+
+	std::printf("                   THD+N 1 kHz  THD+N 10 kHz   cost\n");
+	for (int i = 0; i < delayline::NUM_INTERPOLATIONS; i++) {
+		double ns = bench::nsPerItem([&]() {
+			bench::sink = runDelayLine(low, i)[N - 1];
+		}, N);
+		std::printf("%-16s  %8.1f dB  %9.1f dB  %5.1f ns/sample\n", names[i],
+			thdN(runDelayLine(low, i), lowOmega), thdN(runDelayLine(high, i), highOmega), ns);
+	}
+
+	std::vector<float> y;
+	double ns = bench::nsPerItem([&]() {
+		y = runSrc(low);
+		bench::sink = y.back();
+	}, N);
+	std::printf("%-16s  %8.1f dB  %9.1f dB  %5.1f ns/sample\n", "SRC_SINC_FASTEST",
+		thdN(runSrc(low), lowOmega), thdN(runSrc(high), highOmega), ns * N / y.size());
+	return 0;
+}
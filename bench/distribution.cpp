@@ -0,0 +1,76 @@
+#include "bench.hpp"
+#include "distribution.hpp"
+
+
+/* Tails of the Gaussian module shapes. Checks the normal quantile beyond the
+tables against the exact one, that it joins the table without a step, and
+that every analytic shape reaches the top of the unipolar range at sigma 0.3.
+Fails when any of them is off.
+*/
+static const double MAX_TAIL_ERROR = 1e-4;
+static const double MAX_STEP = 1e-4;
+static const float MIN_REACH = 0.99f;
+
+// Exact standard normal quantile, by bisection on the CDF
+static double normalQuantile(double p) {
+	double lo = -12.0;
+	double hi = 12.0;
+	for (int j = 0; j < 80; j++) {
+		double mid = 0.5 * (lo + hi);
+		if (0.5 * std::erfc(-mid / M_SQRT2) < p)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return 0.5 * (lo + hi);
+}
+
+int main() {
+	using namespace distribution;
+	bool fail = false;
+
+	Engine engine;
+	engine.setShape(NORMAL, false);
+	const Table& q = engine.quantiles();
+
+	// Both tails, from 1e-9 up to the end of the table
+	double worst = 0.0;
+	for (int i = 0; i <= 1000; i++) {
+		float p = std::pow(10.f, -9.f + i * (std::log10(TAIL) + 9.f) / 1000.f);
+		worst = std::max(worst, std::fabs(engine.quantile(q, p) - normalQuantile(p)));
+		float p1 = 1.f - p;
+		if (p1 < 1.f)
+			worst = std::max(worst, std::fabs(engine.quantile(q, p1) - normalQuantile(p1)));
+	}
+	std::printf("normal tail: max error %.3g sigma\n", worst);
+	if (worst > MAX_TAIL_ERROR) {
+		std::printf("FAIL: tail error over %.3g\n", MAX_TAIL_ERROR);
+		fail = true;
+	}
+
+	float step = 0.f;
+	for (float p : {TAIL, 1.f - TAIL}) {
+		float below = std::nextafter(p, 0.f);
+		float above = std::nextafter(p, 1.f);
+		step = std::max(step, std::fabs(engine.quantile(q, above) - engine.quantile(q, below)));
+	}
+	std::printf("normal tail: step where it joins the table %.3g sigma\n", step);
+	if (step > MAX_STEP) {
+		std::printf("FAIL: step over %.3g\n", MAX_STEP);
+		fail = true;
+	}
+
+	// The largest uniform below 1
+	float_4 u = std::nextafter(1.f, 0.f);
+	const char* names[] = {"normal", "laplace", "cauchy"};
+	for (int shape = NORMAL; shape <= CAUCHY; shape++) {
+		engine.setShape(shape, true);
+		float top = engine.sample(0, u, 0.f, 0.3f)[0];
+		std::printf("%-8s unipolar, sigma 0.3: top %.4f\n", names[shape], top);
+		if (top < MIN_REACH) {
+			std::printf("FAIL: %s stops under %.2f\n", names[shape], MIN_REACH);
+			fail = true;
+		}
+	}
+	return fail ? 1 : 0;
+}
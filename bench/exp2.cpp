@@ -0,0 +1,57 @@
+#include "bench.hpp"
+#include "approx.hpp"
+
+
+/* Tuning error of approx::exp2 over the whole V/Oct range, then its cost
+against std::pow(2, x). Fails when the error goes over the bound documented
+in approx.hpp.
+*/
+static const double MAX_ERROR = 1.79e-7;
+
+int main() {
+	// Every float_4 lane is checked, with different fractions in each
+	double worst = 0.0;
+	double worst4 = 0.0;
+	for (int i = -1000000; i <= 1000000; i++) {
+		float x = i * 1e-5f;
+		float_4 x4 = float_4(x, x + 0.25f, x - 0.5f, x * 0.5f);
+		float_4 y4 = approx::exp2(x4);
+		worst = std::max(worst, std::fabs(approx::exp2(x) / std::exp2((double) x) - 1.0));
+		for (int j = 0; j < 4; j++)
+			worst4 = std::max(worst4, std::fabs(y4[j] / std::exp2((double) x4[j]) - 1.0));
+	}
+	double cents = 1200.0 * std::log2(1.0 + std::max(worst, worst4));
+	std::printf("max relative error: exp2 %.4g, exp2 float_4 %.4g (%.5f cents)\n", worst, worst4, cents);
+
+	const int N = 1 << 23;
+	double powNs = bench::nsPerItem([&]() {
+		float acc = 0.f;
+		for (int i = 0; i < N; i++)
+			acc += std::pow(2.f, (i & 1023) * 1e-2f - 5.f);
+		bench::sink = acc;
+	}, N);
+
+	double exp2Ns = bench::nsPerItem([&]() {
+		float acc = 0.f;
+		for (int i = 0; i < N; i++)
+			acc += approx::exp2((i & 1023) * 1e-2f - 5.f);
+		bench::sink = acc;
+	}, N);
+
+	double exp2SimdNs = bench::nsPerItem([&]() {
+		float_4 acc = 0.f;
+		for (int i = 0; i < N; i += 4)
+			acc += approx::exp2(float_4(i & 1023, (i + 1) & 1023, (i + 2) & 1023, (i + 3) & 1023) * 1e-2f - 5.f);
+		bench::sink = acc[0] + acc[1] + acc[2] + acc[3];
+	}, N);
+
+	std::printf("std::pow(2, x)   %5.2f ns/value\n", powNs);
+	std::printf("exp2(float)      %5.2f ns/value  (%.1fx)\n", exp2Ns, powNs / exp2Ns);
+	std::printf("exp2(float_4)    %5.2f ns/value  (%.1fx)\n", exp2SimdNs, powNs / exp2SimdNs);
+
+	if (worst > MAX_ERROR || worst4 > MAX_ERROR) {
+		std::printf("FAIL: tuning error over %.3g\n", MAX_ERROR);
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,111 @@
+#include "bench.hpp"
+#include "HookeOsc.cpp"
+
+
+/* HookeOsc integrators, accuracy against CPU: pitch error from the FREQ
+setting for the classic spring at 1x, 2x and 4x and for exact tuning, then
+the cost per sample of 16 voices. Last, a check that coupled exact springs
+trade energy.
+*/
+Plugin* pluginInstance;
+
+static const float SAMPLE_RATE = 48000.f;
+
+static void setup(HookeOsc& m, int oversampling, bool exact, int voices) {
+	m.setOversampling(oversampling);
+	m.setExact(exact);
+	m.inputs[HookeOsc::PITCH_INPUT].setChannels(voices);
+}
+
+static Module::ProcessArgs processArgs() {
+	Module::ProcessArgs args;
+	args.sampleRate = SAMPLE_RATE;
+	args.sampleTime = 1.f / SAMPLE_RATE;
+	args.frame = 0;
+	return args;
+}
+
+// Frequency of the first voice from its rising zero crossings over 2 s
+static double measurePitch(float freq, int oversampling, bool exact) {
+	HookeOsc m;
+	setup(m, oversampling, exact, 1);
+	m.inputs[HookeOsc::PITCH_INPUT].setVoltage(std::log2(freq / dsp::FREQ_C4));
+	Module::ProcessArgs args = processArgs();
+
+	double previous = 0.0, first = -1.0, last = -1.0;
+	int crossings = 0;
+	int settle = (int) (SAMPLE_RATE * 0.2f);
+	for (int n = 0; n < 2 * (int) SAMPLE_RATE; n++) {
+		m.process(args);
+		double x = m.outputs[HookeOsc::OUT_OUTPUT].getVoltage(0);
+		if (n > settle && previous < 0.0 && x >= 0.0) {
+			double t = n - 1 + previous / (previous - x);
+			if (first < 0.0)
+				first = t;
+			else
+				crossings++;
+			last = t;
+		}
+		previous = x;
+	}
+	return crossings * SAMPLE_RATE / (last - first);
+}
+
+static double nsPerSample(int oversampling, bool exact) {
+	const int N = 1 << 18;
+	HookeOsc m;
+	setup(m, oversampling, exact, 16);
+	for (int c = 0; c < 16; c++)
+		m.inputs[HookeOsc::PITCH_INPUT].setVoltage(c * 0.25f - 2.f, c);
+	Module::ProcessArgs args = processArgs();
+	return bench::nsPerItem([&]() {
+		for (int n = 0; n < N; n++)
+			m.process(args);
+		bench::sink = m.outputs[HookeOsc::OUT_OUTPUT].getVoltage(0);
+	}, N);
+}
+
+// Smallest and largest peak of the first of two coupled springs over 10 s
+static void coupledPeaks(float& lo, float& hi) {
+	HookeOsc m;
+	setup(m, 1, true, 2);
+	m.coupling = HookeOsc::COUPLING_CHAIN;
+	m.inputs[HookeOsc::PITCH_INPUT].setVoltage(0.f, 0);
+	m.inputs[HookeOsc::PITCH_INPUT].setVoltage(0.1f, 1);
+	Module::ProcessArgs args = processArgs();
+
+	lo = INFINITY;
+	hi = 0.f;
+	float x0 = 0.f, x1 = 0.f;
+	for (int n = 0; n < 10 * (int) SAMPLE_RATE; n++) {
+		m.process(args);
+		float x = m.outputs[HookeOsc::OUT_OUTPUT].getVoltage(0) / 5.f;
+		if (n > 2 && x1 > x0 && x1 >= x) {
+			lo = std::min(lo, x1);
+			hi = std::max(hi, x1);
+		}
+		x0 = x1;
+		x1 = x;
+	}
+}
+
+int main() {
+	std::printf("pitch error from the setting, cents\n");
+	std::printf("setting    classic 1x  classic 2x  classic 4x       exact\n");
+	for (float freq : {55.f, 261.63f, 1000.f, 2000.f, 4000.f}) {
+		std::printf("%7.0f Hz", freq);
+		for (int oversampling : {1, 2, 4})
+			std::printf("  %+10.2f", 1200.0 * std::log2(measurePitch(freq, oversampling, false) / freq));
+		std::printf("  %+10.3f\n", 1200.0 * std::log2(measurePitch(freq, 1, true) / freq));
+	}
+
+	std::printf("\ncost of 16 voices\n");
+	for (int oversampling : {1, 2, 4})
+		std::printf("classic %dx  %7.1f ns/sample\n", oversampling, nsPerSample(oversampling, false));
+	std::printf("exact       %7.1f ns/sample\n", nsPerSample(1, true));
+
+	float lo, hi;
+	coupledPeaks(lo, hi);
+	std::printf("\nexact, two coupled springs: peaks of the first from %.3f to %.3f\n", lo, hi);
+	return 0;
+}
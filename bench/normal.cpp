@@ -0,0 +1,55 @@
+#include "bench.hpp"
+#include "prng.hpp"
+
+
+/* Cost of one normal deviate: Rack's random::normal() against the ziggurat of
+prng.hpp, one at a time and by blocks as Gaussian uses it.
+*/
+int main() {
+	random::init();
+	const int N = 1 << 22;
+	const int BLOCK = 64;
+	static float block[BLOCK];
+	prng::Xoshiro128 g;
+
+	double rackNs = bench::nsPerItem([&]() {
+		float acc = 0.f;
+		for (int i = 0; i < N; i++)
+			acc += random::normal();
+		bench::sink = acc;
+	}, N);
+
+	double normalNs = bench::nsPerItem([&]() {
+		float acc = 0.f;
+		for (int i = 0; i < N; i++)
+			acc += prng::normal(g);
+		bench::sink = acc;
+	}, N);
+
+	double fillNs = bench::nsPerItem([&]() {
+		float acc = 0.f;
+		for (int i = 0; i < N; i += BLOCK) {
+			prng::fillNormal(g, block, BLOCK);
+			acc += block[i & (BLOCK - 1)];
+		}
+		bench::sink = acc;
+	}, N);
+
+	// Sanity check of the ziggurat, the 4th moment catches a wrong tail
+	double m1 = 0.0, m2 = 0.0, m4 = 0.0;
+	for (int i = 0; i < N; i++) {
+		double x = prng::normal(g);
+		m1 += x;
+		m2 += x * x;
+		m4 += x * x * x * x;
+	}
+	m1 /= N;
+	m2 /= N;
+	m4 /= N;
+
+	std::printf("random::normal()      %6.2f ns/sample\n", rackNs);
+	std::printf("prng::normal()        %6.2f ns/sample  (%.1fx)\n", normalNs, rackNs / normalNs);
+	std::printf("prng::fillNormal(%d)  %6.2f ns/sample  (%.1fx)\n", BLOCK, fillNs, rackNs / fillNs);
+	std::printf("mean %+.4f  variance %.4f  kurtosis %.3f (expected 0, 1, 3)\n", m1, m2, m4 / (m2 * m2));
+	return 0;
+}
@@ -1,4 +1,10 @@
 #include "plugin.hpp"
+#include "prng.hpp"
+#include "distribution.hpp"
+#include "noise.hpp"
+
+
+static const int maxPolyphony = engine::PORT_MAX_CHANNELS;
 
 
 struct Gaussian : Module {
@@ -8,6 +14,7 @@ struct Gaussian : Module {
 		SIGMA_PARAM,
 		SIGMAMOD_PARAM,
 		OFFSET_PARAM,
+		CORR_PARAM,
 		NUM_PARAMS
 	};
 	enum InputIds {
@@ -24,11 +31,25 @@ struct Gaussian : Module {
 		NUM_LIGHTS
 	};
 
-    dsp::SchmittTrigger trigTrigger;
-	//float lastValue = 0.f;
-	float value = 0.f;
-	float mu;
-	float sigma;
+	dsp::TSchmittTrigger<float_4> trigTriggers[4];
+	float_4 values[4] = {};
+	int channels = 1;
+	// 0 follows the inputs, otherwise a fixed number of output channels
+	int channelsSetting = 0;
+	
+	prng::Stream stream;
+	float uniforms[maxPolyphony] = {};
+	float normals[maxPolyphony] = {};
+	distribution::Correlation correlation;
+	
+	int shape = distribution::NORMAL;
+	distribution::Engine engine;
+	// Set by the density editor, the table is rebuilt on the audio thread
+	bool drawnDirty = false;
+	
+	// Spectrum of the noise, when the trigger input is not connected
+	int color = noise::WHITE;
+	noise::ColoredNoise coloredNoise;
 	
 	Gaussian() {
 		config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
@@ -37,48 +58,170 @@ struct Gaussian : Module {
 		configParam(SIGMA_PARAM, 0.f, 1.f, 0.1f, "Sigma");
 		configParam(SIGMAMOD_PARAM, 0.f, 1.f, 0.f, "Sigma modulation");
 		configParam(OFFSET_PARAM, 0.f, 1.f, 0.f, "Offset");
+		configParam(CORR_PARAM, -1.f, 1.f, 0.f, "Correlation between channels", "%", 0.f, 100.f);
+	}
+
+	json_t* dataToJson() override {
+		json_t* rootJ = json_object();
+		stream.toJson(rootJ);
+		json_object_set_new(rootJ, "shape", json_integer(shape));
+		json_object_set_new(rootJ, "channels", json_integer(channelsSetting));
+		json_object_set_new(rootJ, "color", json_integer(color));
+		json_t* densityJ = json_array();
+		for (int i=0; i<distribution::DRAWN_BINS; i++)
+			json_array_append_new(densityJ, json_real(engine.drawn.density[i]));
+		json_object_set_new(rootJ, "density", densityJ);
+		return rootJ;
+	}
+
+	void dataFromJson(json_t* rootJ) override {
+		stream.fromJson(rootJ);
+		json_t* shapeJ = json_object_get(rootJ, "shape");
+		if (shapeJ)
+			shape = clamp((int) json_integer_value(shapeJ), 0, distribution::NUM_SHAPES - 1);
+		json_t* channelsJ = json_object_get(rootJ, "channels");
+		if (channelsJ)
+			channelsSetting = clamp((int) json_integer_value(channelsJ), 0, maxPolyphony);
+		json_t* colorJ = json_object_get(rootJ, "color");
+		if (colorJ)
+			color = clamp((int) json_integer_value(colorJ), 0, noise::NUM_COLORS - 1);
+		json_t* densityJ = json_object_get(rootJ, "density");
+		if (densityJ && json_array_size(densityJ) == distribution::DRAWN_BINS) {
+			for (int i=0; i<distribution::DRAWN_BINS; i++)
+				engine.drawn.density[i] = json_number_value(json_array_get(densityJ, i));
+			drawnDirty = true;
+		}
+	}
+
+	void onReset() override {
+		stream.restart();
+		channelsSetting = 0;
+		color = noise::WHITE;
+		shape = distribution::NORMAL;
+		engine.drawn.reset();
+		drawnDirty = true;
 	}
 
 	void process(const ProcessArgs& args) override {
-	    if (inputs[TRIGGER_INPUT].isConnected()) {
-	        // Trigger input is connected
-			if (trigTrigger.process(rescale(inputs[TRIGGER_INPUT].getVoltage(), 0.1f, 2.f, 0.f, 1.f))) {
-				sample();
-			}
-		} else {
-		    // Trigger input is not connected, generate noise
-		    if (outputs[CV_OUTPUT].isConnected()) {
-		        sample();
-		    }
+	    channels = channelsSetting;
+	    if (channels == 0) {
+	        channels = std::max(std::max(1, inputs[TRIGGER_INPUT].getChannels()),
+	                            std::max(inputs[SIGMACV_INPUT].getChannels(), inputs[MUCV_INPUT].getChannels()));
+	    }
+	    
+	    bool triggered = inputs[TRIGGER_INPUT].isConnected();
+	    // Trigger input is not connected, generate noise (only if someone listens)
+	    bool draw = !triggered && outputs[CV_OUTPUT].isConnected();
+	    float_4 trig[4];
+	    for (int c=0; c<channels; c+=4) {
+	        trig[c/4] = float_4::mask();
+	        if (triggered) {
+	            trig[c/4] = trigTriggers[c/4].process(inputs[TRIGGER_INPUT].getPolyVoltageSimd<float_4>(c), 0.1f, 2.f);
+	            draw |= simd::movemask(trig[c/4]) != 0;
+	        }
+	    }
+	    
+	    if (draw) {
+	        // Params are read once per frame, not once per voice
+	        float sigmaParam = params[SIGMA_PARAM].getValue();
+	        float sigmamod = params[SIGMAMOD_PARAM].getValue() / 10.f;
+	        float muParam = params[MU_PARAM].getValue();
+	        float mumod = params[MUMOD_PARAM].getValue() / 10.f;
+	        bool unipolar = params[OFFSET_PARAM].getValue() != 0.f;
+	        float rho = params[CORR_PARAM].getValue();
+	        bool sigmaCV = inputs[SIGMACV_INPUT].isConnected();
+	        bool muCV = inputs[MUCV_INPUT].isConnected();
+	        
+	        // Tables are only touched when the shape or the drawing changed
+	        engine.setShape(shape, unipolar);
+	        if (drawnDirty) {
+	            drawnDirty = false;
+	            engine.rebuildDrawn();
+	        }
+	        
+	        bool colored = !triggered && color != noise::WHITE;
+	        
+	        // Next colored noise frame, or one uniform per voice
+	        if (colored) {
+	            // Mapped to uniforms like the correlated draws, a monotonic map keeps the color,
+	            // and the shape and range are the same as for white noise
+	            coloredNoise.step(stream, color, channels, args.sampleTime);
+	            for (int c=0; c<channels; c+=4)
+	                coloredNoise.get(c).store(&normals[c]);
+	            for (int i=0; i<channels; i++)
+	                uniforms[i] = distribution::normalCdf(normals[i]);
+	        } else if (channels > 1 && rho != 0.f) {
+	            // Correlated normals, mapped back to uniforms (gaussian copula),
+	            // so that the correlation holds for every shape
+	            correlation.update(channels, rho);
+	            prng::fillNormal(stream, normals, channels);
+	            correlation.apply(normals, uniforms);
+	            for (int i=0; i<channels; i++)
+	                uniforms[i] = distribution::normalCdf(uniforms[i]);
+	        } else {
+	            prng::fillUniform(stream, uniforms, channels);
+	        }
+	        
+	        for (int c=0; c<channels; c+=4) {
+	            if (simd::movemask(trig[c/4]) == 0)
+	                continue;
+	            
+	            float_4 sigma = sigmaParam;
+	            if (sigmaCV) {
+	                sigma += sigmamod * inputs[SIGMACV_INPUT].getPolyVoltageSimd<float_4>(c);
+	                sigma = simd::clamp(sigma, 0.f, 1.f);
+	            }
+	            float_4 mu = muParam;
+	            if (muCV) {
+	                mu += mumod * inputs[MUCV_INPUT].getPolyVoltageSimd<float_4>(c);
+	                mu = simd::clamp(mu, -1.f, 1.f);
+	            }
+	            
+	            values[c/4] = simd::ifelse(trig[c/4], engine.sample(c, float_4::load(&uniforms[c]), mu, sigma), values[c/4]);
+	        }
 		}
 		
-		outputs[CV_OUTPUT].setVoltage(value * 10.f);
+		outputs[CV_OUTPUT].setChannels(channels);
+		for (int c=0; c<channels; c+=4) {
+		    outputs[CV_OUTPUT].setVoltageSimd(values[c/4] * 10.f, c);
+		}
 	}
+};
+
+
+// Click and drag to paint the density of the "Drawn" shape
+struct DensityEditor : PaintWidget {
+	Gaussian* module;
 	
-	void sample() {
-	    sigma = params[SIGMA_PARAM].getValue();
-	    float sigmamod = params[SIGMAMOD_PARAM].getValue();
-	    if (inputs[SIGMACV_INPUT].isConnected()) {
-            sigma += sigmamod * inputs[SIGMACV_INPUT].getVoltage(0) / 10.f;
-            sigma = clamp(sigma, 0.f, 1.f);
-        }
-        
-        mu = params[MU_PARAM].getValue();
-        float mumod = params[MUMOD_PARAM].getValue();
-        if (inputs[MUCV_INPUT].isConnected()) {
-            mu += mumod * inputs[MUCV_INPUT].getVoltage(0) / 10.f;
-            mu = clamp(mu, -1.f, 1.f);
-        }
-	    
-	    if (params[OFFSET_PARAM].getValue() == 0.f) {
-            // Bipolar
-            value = random::normal() * sigma;
-            value = mu + clamp(value, -0.5f, 0.5f);
-        } else {
-            // Unipolar
-            value = std::fabs(random::normal()) * sigma;
-            value = mu + clamp(value, 0.f, 1.f);
-        }
+	DensityEditor() {
+		box.size = Vec(distribution::DRAWN_BINS * 5, 60);
+	}
+	
+	void draw(const DrawArgs& args) override {
+		PaintWidget::draw(args);
+		
+		float peak = 0.f;
+		for (int i=0; i<distribution::DRAWN_BINS; i++)
+			peak = std::max(peak, module->engine.drawn.density[i]);
+		if (peak <= 0.f)
+			return;
+		
+		float w = box.size.x / distribution::DRAWN_BINS;
+		nvgBeginPath(args.vg);
+		for (int i=0; i<distribution::DRAWN_BINS; i++) {
+			float h = module->engine.drawn.density[i] / peak * box.size.y;
+			nvgRect(args.vg, i * w, box.size.y - h, w - 1, h);
+		}
+		nvgFillColor(args.vg, nvgRGB(0xf0, 0xf0, 0xf0));
+		nvgFill(args.vg);
+	}
+	
+	void paint(Vec pos) override {
+		int i = (int) (pos.x / box.size.x * distribution::DRAWN_BINS);
+		if (i < 0 || i >= distribution::DRAWN_BINS)
+			return;
+		module->engine.drawn.density[i] = clamp(1.f - pos.y / box.size.y, 0.f, 1.f);
+		module->drawnDirty = true;
 	}
 };
 
@@ -104,6 +247,27 @@ struct GaussianWidget : ModuleWidget {
 
 		addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(10.16, 113.475)), module, Gaussian::CV_OUTPUT));
 	}
+
+	void appendContextMenu(Menu* menu) override {
+		Gaussian* module = dynamic_cast<Gaussian*>(this->module);
+		
+		menu->addChild(new MenuSeparator);
+		std::vector<std::string> channelLabels = {"Follow inputs"};
+		for (int i=1; i<=maxPolyphony; i++)
+			channelLabels.push_back(string::f("%d", i));
+		menu->addChild(createIndexPtrSubmenuItem("Channels", channelLabels, &module->channelsSetting));
+		menu->addChild(createParamSlider(module, Gaussian::CORR_PARAM));
+		
+		menu->addChild(createIndexPtrSubmenuItem("Noise color", {"White", "Pink", "Brown", "Blue"}, &module->color));
+		menu->addChild(createIndexPtrSubmenuItem("Shape", {"Normal", "Laplace", "Cauchy", "Drawn"}, &module->shape));
+		if (module->shape == distribution::DRAWN) {
+			DensityEditor* editor = new DensityEditor;
+			editor->module = module;
+			menu->addChild(editor);
+		}
+		
+		prng::appendSeedMenu(menu, &module->stream);
+	}
 };
 
 
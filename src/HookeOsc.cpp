@@ -1,7 +1,7 @@
 #include "plugin.hpp"
-
-#define RAISING 1
-#define FALLING 0
+#include "prng.hpp"
+#include "approx.hpp"
+#include "oversample.hpp"
 
 static const int maxPolyphony = engine::PORT_MAX_CHANNELS;
 
@@ -13,6 +13,7 @@ struct HookeOsc : Module {
 		CHAOS_PARAM,
 		CHAOSFREQ_PARAM,
 		SLOW_PARAM,
+		COUPLING_PARAM,
 		NUM_PARAMS
 	};
 	enum InputIds {
@@ -34,12 +35,60 @@ struct HookeOsc : Module {
 	
 	bool applyChaos = false;
 	
-	int state[maxPolyphony] = {};
-	float spring_k[maxPolyphony] = {};
-	float spring_kp[maxPolyphony] = {0.f};
-	float vel[maxPolyphony] = {};
-	float value[maxPolyphony] = {};
-	float prev_value[maxPolyphony] = {};
+	prng::Stream stream;
+	
+	// Voice state, 4 voices per float_4
+	// raising is a lane mask, set while the spring goes up
+	float_4 raising[4] = {};
+	float_4 spring_k[4] = {};
+	float_4 spring_kp[4] = {};
+	float_4 vel[4] = {};
+	float_4 value[4] = {};
+	float_4 prev_value[4] = {};
+	// Frequency is only recomputed when the pitch moves
+	float_4 lastPitch[4];
+	float_4 freq[4];
+	
+	// Anti-aliasing, the springs run 1, 2 or 4 times per sample.
+	// A substep is the exact root of the 1x step, so the pitch is the same at every rate
+	int oversampling = 1;
+	oversample::HalfBandDecimator<float_4> decimators[2][4];
+	float_4 rootK[4] = {};
+	float_4 rootA[4] = {};
+	float_4 rootB[4] = {};
+	float_4 phiSin[4] = {};
+	float_4 phiCos[4] = {};
+	float_4 thetaCos[4] = {};
+	float_4 thetaSinInv[4] = {};
+	
+	// Springs coupled to each other, the matrix is rebuilt when the topology or voice count change
+	enum Coupling {
+		COUPLING_OFF,
+		COUPLING_CHAIN,
+		COUPLING_RING,
+		COUPLING_ALL,
+		NUM_COUPLINGS
+	};
+	int coupling = COUPLING_OFF;
+	int matrixCoupling = -1;
+	int matrixVoices = 0;
+	// Graph laplacian, stored by columns
+	float laplacian[maxPolyphony][maxPolyphony] = {};
+	// Held for the 4 samples of a control period
+	float_4 couplingAcc[4] = {};
+	
+	// Exact integrator, the spring turns by a fixed angle every sample.
+	// vel then holds the velocity divided by the angular frequency.
+	bool exact = false;
+	float_4 rotTheta[4] = {};
+	float_4 rotCos[4];
+	float_4 rotSin[4] = {};
+	// Squared radius the spring is held to, only coupling kicks move it
+	float_4 rotRadius2[4];
+	
+	// Set from the menu, applied on the audio thread, -1 when nothing is pending
+	int pendingOversampling = -1;
+	int pendingExact = -1;
 	
 	HookeOsc() {
 		config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
@@ -48,16 +97,85 @@ struct HookeOsc : Module {
 		configParam(KCVMOD_PARAM, -1.f, 1.f, 0.f, "K/m modulation");
 		configParam(CHAOS_PARAM, 0.f, 1.f, 0.f, "Chaos amount");
 		configParam(CHAOSFREQ_PARAM, 0.1f, 1.f, 0.1f, "Chaos frequency");
+		configParam(COUPLING_PARAM, 0.f, 1.f, 0.2f, "Coupling stiffness", "%", 0.f, 100.f);
 		
 		// Initialize springs extension
-		for (int i=0; i<maxPolyphony; i++) {
-		    value[i] = 1.f;
-		    prev_value[i] = 1.f;
-		    state[i] = FALLING;
+		for (int g=0; g<4; g++) {
+		    value[g] = 1.f;
+		    prev_value[g] = 1.f;
+		    lastPitch[g] = INFINITY;
+		    rotCos[g] = 1.f;
+		    rotRadius2[g] = 1.f;
 		}
 	}
 	
+	json_t* dataToJson() override {
+		json_t* rootJ = json_object();
+		stream.toJson(rootJ);
+		json_object_set_new(rootJ, "oversampling", json_integer(oversampling));
+		json_object_set_new(rootJ, "coupling", json_integer(coupling));
+		json_object_set_new(rootJ, "exact", json_boolean(exact));
+		return rootJ;
+	}
+
+	void dataFromJson(json_t* rootJ) override {
+		stream.fromJson(rootJ);
+		json_t* oversamplingJ = json_object_get(rootJ, "oversampling");
+		if (oversamplingJ)
+			setOversampling(json_integer_value(oversamplingJ));
+		json_t* couplingJ = json_object_get(rootJ, "coupling");
+		if (couplingJ)
+			coupling = clamp((int) json_integer_value(couplingJ), 0, NUM_COUPLINGS - 1);
+		json_t* exactJ = json_object_get(rootJ, "exact");
+		if (exactJ)
+			setExact(json_boolean_value(exactJ));
+	}
+	
+	void setExact(bool exact) {
+		if (exact == this->exact)
+			return;
+		this->exact = exact;
+		// The two integrators don't share the meaning of vel, restart the springs
+		for (int g=0; g<4; g++) {
+			value[g] = 1.f;
+			prev_value[g] = 1.f;
+			vel[g] = 0.f;
+			rotRadius2[g] = 1.f;
+		}
+	}
+	
+	void setOversampling(int oversampling) {
+		if (oversampling != 2 && oversampling != 4)
+			oversampling = 1;
+		this->oversampling = oversampling;
+		for (int s=0; s<2; s++) {
+			for (int g=0; g<4; g++)
+				decimators[s][g].reset();
+		}
+		// Recompute the root and the wall constants for the new rate
+		for (int g=0; g<4; g++)
+			rootK[g] = -1.f;
+	}
+
+	void onReset() override {
+		stream.restart();
+		pendingOversampling = pendingExact = -1;
+		setOversampling(1);
+		coupling = COUPLING_OFF;
+		setExact(false);
+	}
+
 	void process(const ProcessArgs& args) override {
+	    int oversampling = pendingOversampling;
+	    if (oversampling >= 0) {
+	        pendingOversampling = -1;
+	        setOversampling(oversampling);
+	    }
+	    int exact = pendingExact;
+	    if (exact >= 0) {
+	        pendingExact = -1;
+	        setExact(exact);
+	    }
 	    timeCounter += args.sampleTime;
 	    
 	    if (loopCounter-- == 0) {
@@ -74,72 +192,257 @@ struct HookeOsc : Module {
         
 	    float pitchParam = params[FREQ_PARAM].getValue() / 12.f;
 	    
-	    float slow = params[SLOW_PARAM].getValue();
+	    // 6.194130435 is the magic number to tune the oscillator
+	    float tuning = (params[SLOW_PARAM].getValue() == 1.f) ? 0.02173913f : 6.194130435f;
 	    
 	    // CHAOS
 	    float chaos = params[CHAOS_PARAM].getValue() * 10.f;
 	    float chaosFreq = params[CHAOSFREQ_PARAM].getValue() * 0.1f;
 	    
 	    
-	    for (int i=0; i<currentPolyphony; i++) {
-	        
-	        float pitch = pitchParam + inputs[PITCH_INPUT].getVoltage(i);
-	        float freq = dsp::FREQ_C4 * std::pow(2.f, pitch);
-	        
-	        
-	        // 6.194130435 is the magic number to tune the oscillator
-	        if (slow == 1.f) {
-	            spring_k[i] = freq * args.sampleTime * 0.02173913f;
-	        } else {
-	            spring_k[i] = freq * args.sampleTime * 6.194130435f;
+	    for (int c=0; c<currentPolyphony; c+=4) {
+	        int g = c / 4;
+	        float_4 pitch = pitchParam + inputs[PITCH_INPUT].getVoltageSimd<float_4>(c);
+	        if (simd::movemask(pitch != lastPitch[g])) {
+	            lastPitch[g] = pitch;
+	            freq[g] = approx::voltToFreq(pitch);
 	        }
+	        spring_k[g] = freq[g] * args.sampleTime * tuning;
 	        
-	        spring_kp[i] = 0.0f;
-	        if ((state[i] == RAISING) && (value[i] < prev_value[i])) {
-	            // Switch state and apply chaos
-	            state[i] = FALLING;
-	            if (random::uniform() < chaosFreq)
-	                spring_kp[i] = spring_k[i] * (random::normal()-0.44f) * chaos * 0.7f;
-	            
-	        } else if ((state[i] == FALLING) && (value[i] > prev_value[i])) {
-	            // Switch state and apply chaos
-	            state[i] = RAISING;
-	            if (random::uniform() < chaosFreq)
-	                spring_kp[i] = spring_k[i] * (random::normal()-0.44f) * chaos * 0.7f;
+	        // Switch state on every turning point, and maybe apply chaos
+	        float_4 turned = (raising[g] & (value[g] < prev_value[g])) | (~raising[g] & (value[g] > prev_value[g]));
+	        raising[g] ^= turned;
+	        spring_kp[g] = 0.f;
+	        
+	        int turnedMask = simd::movemask(turned);
+	        if (turnedMask && chaos > 0.f) {
+	            for (int i=0; i<4; i++) {
+	                if ((turnedMask & (1 << i)) && prng::uniform(stream) < chaosFreq)
+	                    spring_kp[g][i] = spring_k[g][i] * (prng::normal(stream)-0.44f) * chaos * 0.7f;
+	            }
 	        }
-	        //spring_k[i] += spring_k[i] * chaos;
 	        
-	        //spring_k[i] += k_mod;
-	        prev_value[i] = value[i];
+	        prev_value[g] = value[g];
         }
+        
+        updateCoupling();
+	}
+	
+	void updateCoupling() {
+	    int n = currentPolyphony;
+	    if (coupling == COUPLING_OFF || n < 2) {
+	        for (int g=0; g<4; g++)
+	            couplingAcc[g] = 0.f;
+	        return;
+	    }
+	    
+	    if (coupling != matrixCoupling || n != matrixVoices)
+	        buildLaplacian(n);
+	    
+	    float x[maxPolyphony];
+	    for (int c=0; c<n; c+=4)
+	        value[c/4].store(&x[c]);
+	    
+	    // Pull every spring towards its neighbours, relative to its own stiffness
+	    float stiffness = params[COUPLING_PARAM].getValue();
+	    for (int c=0; c<n; c+=4) {
+	        float_4 lx = 0.f;
+	        for (int j=0; j<n; j++)
+	            lx += float_4::load(&laplacian[j][c]) * x[j];
+	        couplingAcc[c/4] = -stiffness * spring_k[c/4] * spring_k[c/4] * lx;
+	    }
+	}
+	
+	void buildLaplacian(int n) {
+	    matrixCoupling = coupling;
+	    matrixVoices = n;
+	    std::memset(laplacian, 0, sizeof(laplacian));
+	    
+	    auto link = [&](int i, int j, float w) {
+	        laplacian[i][i] += w;
+	        laplacian[j][j] += w;
+	        laplacian[j][i] -= w;
+	        laplacian[i][j] -= w;
+	    };
+	    
+	    if (coupling == COUPLING_ALL) {
+	        // Normalized so every spring feels the same total pull as in a chain
+	        for (int i=0; i<n; i++) {
+	            for (int j=i+1; j<n; j++)
+	                link(i, j, 2.f / (n - 1));
+	        }
+	    } else {
+	        for (int i=0; i+1<n; i++)
+	            link(i, i+1, 1.f);
+	        if (coupling == COUPLING_RING && n > 2)
+	            link(n-1, 0, 1.f);
+	    }
 	}
 	
 	void generateOutput() {
-	    float k;
-	    float k_mod = 0.f;
 	    int kmodPolyphony = inputs[KMOD_INPUT].getChannels();
+	    float kmodAmount = params[KCVMOD_PARAM].getValue() * 0.1f;
 	    
-	    for (int i=0; i<currentPolyphony; i++) {
-	        if (kmodPolyphony > 0) {
-	            k_mod = params[KCVMOD_PARAM].getValue() * inputs[KMOD_INPUT].getVoltage(i % kmodPolyphony) * 0.1f;
-	        }
+	    // K modulation cycles over its channels when it has fewer than the pitch input
+	    float kmod[maxPolyphony];
+	    if (kmodPolyphony > 1 && kmodPolyphony < currentPolyphony) {
+	        for (int i=0; i<currentPolyphony; i++)
+	            kmod[i] = inputs[KMOD_INPUT].getVoltage(i % kmodPolyphony);
+	    }
+	    
+	    for (int c=0; c<currentPolyphony; c+=4) {
+	        int g = c / 4;
+	        float_4 k_mod = 0.f;
+	        if (kmodPolyphony == 1)
+	            k_mod = kmodAmount * inputs[KMOD_INPUT].getVoltage(0);
+	        else if (kmodPolyphony >= currentPolyphony)
+	            k_mod = kmodAmount * inputs[KMOD_INPUT].getVoltageSimd<float_4>(c);
+	        else if (kmodPolyphony > 1)
+	            k_mod = kmodAmount * float_4::load(&kmod[c]);
+	        
+	        float_4 k = spring_k[g] + k_mod + spring_kp[g];
 	        
-	        k = spring_k[i] + k_mod + spring_kp[i];
-            vel[i] += -k*k * value[i];
-            
-            value[i] += vel[i];
-            
-            if (value[i] < -1.f) {
-              value[i] = -0.99f;
-              vel[i] = k*k;
-            } else if (value[i] > 1.f) {
-              value[i] = 0.99f;
-              vel[i] = -k*k;
-            }
+	        float_4 out;
+	        if (exact) {
+	            out = rotateSpring(g, k);
+	        } else if (oversampling == 1) {
+	            out = stepSpring(g, k, couplingAcc[g]);
+	        } else {
+	            // vel is in 1x units, the coupling kick is shared by the substeps
+	            float_4 acc = couplingAcc[g] * (1.f / oversampling);
+	            float_4 x[4];
+	            for (int i=0; i<oversampling; i++)
+	                x[i] = stepSpring(g, k, acc);
+	            if (oversampling == 4) {
+	                x[0] = decimators[0][g].process(x[0], x[1]);
+	                x[1] = decimators[0][g].process(x[2], x[3]);
+	            }
+	            out = decimators[1][g].process(x[0], x[1]);
+	        }
 	        
-	        outputs[OUT_OUTPUT].setVoltage(value[i] * 5.f, i);
+	        outputs[OUT_OUTPUT].setVoltageSimd(out * 5.f, c);
 	    }
 	}
+	
+	// One sample, or one substep when oversampling
+	float_4 stepSpring(int g, float_4 k, float_4 acc) {
+	    float_4 k2 = k * k;
+	    float_4 x0 = value[g];
+	    vel[g] += acc - k2 * value[g];
+	    if (oversampling == 1) {
+	        value[g] += vel[g];
+	    } else {
+	        if (simd::movemask(k != rootK[g]))
+	            updateRoot(g, k);
+	        // vel now holds M applied to the velocity, mix M and the identity
+	        float_4 x = value[g] + vel[g];
+	        vel[g] = rootA[g] * vel[g] + rootB[g] * (vel[g] + k2 * value[g]);
+	        value[g] = rootA[g] * x + rootB[g] * value[g];
+	    }
+	    
+	    if (oversampling == 1) {
+	        // Without anti-aliasing the walls reset the spring at the end of the step, so old patches keep their pitch
+	        float_4 below = value[g] < -1.f;
+	        float_4 above = value[g] > 1.f;
+	        value[g] = simd::ifelse(below, -0.99f, simd::ifelse(above, 0.99f, value[g]));
+	        vel[g] = simd::ifelse(below, k2, simd::ifelse(above, -k2, vel[g]));
+	        return value[g];
+	    }
+	    float_4 hit = (value[g] < -1.f) | (value[g] > 1.f);
+	    if (simd::movemask(hit))
+	        reflect(g, k, x0, hit);
+	    return value[g];
+	}
+	
+	/* The 1x step is the linear map M (symplectic Euler), it turns by theta with
+	cos(theta) = 1 - k^2/2, so sin(theta/2) = k/2. A substep turns by phi = theta/N and is
+	M^(1/N) = (sin(phi) M + sin(theta - phi) I) / sin(theta).
+	Only square roots of k are needed, and they are kept while k doesn't move.
+	*/
+	void updateRoot(int g, float_4 k) {
+	    rootK[g] = k;
+	    float_4 h = simd::clamp(simd::fabs(k) * 0.5f, 1e-6f, 0.999f);
+	    float_4 c = simd::sqrt(1.f - h * h);
+	    thetaCos[g] = 1.f - 2.f * h * h;
+	    thetaSinInv[g] = 0.5f / (h * c);
+	    if (oversampling == 2) {
+	        phiSin[g] = h;
+	        phiCos[g] = c;
+	    } else {
+	        phiCos[g] = simd::sqrt(0.5f * (1.f + c));
+	        phiSin[g] = h / (2.f * phiCos[g]);
+	    }
+	    rootA[g] = phiSin[g] * thetaSinInv[g];
+	    rootB[g] = phiCos[g] - thetaCos[g] * rootA[g];
+	}
+	
+	// Oversampled, reset the springs which crossed a wall at the time of the crossing rather than at the
+	// end of the step, so the period does not snap to the sample grid
+	void reflect(int g, float_4 k, float_4 x0, float_4 hit) {
+	    if (simd::movemask(k != rootK[g]))
+	        updateRoot(g, k);
+	    float_4 x1 = value[g];
+	    float_4 wall = simd::ifelse(x1 > 0.f, 1.f, -1.f);
+	    
+	    // Along the step x(s) = (sin(s phi) x1 + sin((1 - s) phi) x0) / sin(phi), so the crossing
+	    // solves sin(s phi + d) = wall sin(phi) / r, with r and d the polar form of (p, q)
+	    float_4 p = x1 - x0 * phiCos[g];
+	    float_4 q = x0 * phiSin[g];
+	    float_4 rInv = 1.f / simd::sqrt(p * p + q * q);
+	    float_4 sinD = q * rInv;
+	    float_4 cosD = p * rInv;
+	    float_4 sinA = simd::clamp(wall * phiSin[g] * rInv, -1.f, 1.f);
+	    float_4 cosA = simd::sqrt(1.f - sinA * sinA);
+	    // Of the two solutions take the one inside the step, s phi in [0, phi]
+	    float_4 sinS = sinA * cosD - cosA * sinD;
+	    float_4 cosS = cosA * cosD + sinA * sinD;
+	    float_4 inside = (sinS >= 0.f) & (cosS >= phiCos[g]);
+	    sinS = simd::ifelse(inside, sinS, sinA * cosD + cosA * sinD);
+	    cosS = simd::ifelse(inside, cosS, sinA * sinD - cosA * cosD);
+	    inside = (sinS >= 0.f) & (cosS >= phiCos[g]);
+	    sinS = simd::ifelse(inside, sinS, phiSin[g]);
+	    cosS = simd::ifelse(inside, cosS, phiCos[g]);
+	    
+	    // Restart from the wall and run M^r for the rest of the step, r theta = phi - s phi
+	    float_4 sinR = phiSin[g] * cosS - phiCos[g] * sinS;
+	    float_4 cosR = phiCos[g] * cosS + phiSin[g] * sinS;
+	    float_4 a = sinR * thetaSinInv[g];
+	    float_4 b = cosR - thetaCos[g] * a;
+	    float_4 x = 0.99f * wall;
+	    float_4 v = -k * k * wall;
+	    float_4 mv = v - k * k * x;
+	    value[g] = simd::ifelse(hit, a * (x + mv) + b * x, value[g]);
+	    vel[g] = simd::ifelse(hit, a * mv + b * v, vel[g]);
+	}
+	
+	float_4 rotateSpring(int g, float_4 k) {
+	    // k is proportional to the frequency, 6.194130435 is where the classic spring is tuned
+	    float_4 theta = k * (2.f * float(M_PI) / 6.194130435f);
+	    if (simd::movemask(theta != rotTheta[g])) {
+	        // Only when the pitch, K modulation or a chaos kick moved
+	        rotTheta[g] = theta;
+	        rotCos[g] = simd::cos(theta);
+	        rotSin[g] = simd::sin(theta);
+	    }
+	    
+	    // Coupling comes as one kick per control period, from the positions it was computed with.
+	    // Held over the period it would lag the springs and pump energy into them
+	    float_4 kick = (loopCounter == 3) ? couplingAcc[g] * 4.f : float_4(0.f);
+	    float_4 dy = simd::ifelse(theta != 0.f, kick / theta, 0.f);
+	    rotRadius2[g] += dy * (2.f * vel[g] + dy);
+	    float_4 y = vel[g] + dy;
+	    float_4 x = rotCos[g] * value[g] + rotSin[g] * y;
+	    y = rotCos[g] * y - rotSin[g] * value[g];
+	    
+	    // Pull the radius back so rounding errors don't grow or fade the spring.
+	    // The error is tiny, so the rough reciprocal is enough
+	    float_4 r2 = rotRadius2[g];
+	    float_4 gain = 1.f + 0.5f * (r2 - (x * x + y * y)) * simd::rcp(r2);
+	    gain = simd::ifelse(r2 > 0.f, gain, 1.f);
+	    value[g] = x * gain;
+	    vel[g] = y * gain;
+	    return value[g];
+	}
 };
 
 
@@ -163,6 +466,23 @@ struct HookeOscWidget : ModuleWidget {
 
 		addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(12.7, 112.417)), module, HookeOsc::OUT_OUTPUT));
 	}
+
+	void appendContextMenu(Menu* menu) override {
+		HookeOsc* module = dynamic_cast<HookeOsc*>(this->module);
+		
+		menu->addChild(new MenuSeparator);
+		menu->addChild(createIndexSubmenuItem("Anti-aliasing", {"Off", "2x oversampling", "4x oversampling"},
+			[=]() {return (module->oversampling == 4) ? 2 : module->oversampling - 1;},
+			[=](int i) {module->pendingOversampling = 1 << i;}
+		));
+		menu->addChild(createBoolMenuItem("Exact tuning", "",
+			[=]() {return module->exact;},
+			[=](bool exact) {module->pendingExact = exact;}
+		));
+		menu->addChild(createIndexPtrSubmenuItem("Coupling", {"Off", "Chain", "Ring", "All to all"}, &module->coupling));
+		menu->addChild(createParamSlider(module, HookeOsc::COUPLING_PARAM));
+		prng::appendSeedMenu(menu, &module->stream);
+	}
 };
 
 
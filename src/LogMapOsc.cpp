@@ -1,10 +1,80 @@
 #include "plugin.hpp"
+#include "approx.hpp"
+#include "blamp.hpp"
+
+
+// Corner of the chaos modulation smoothing, in Hz
+static const float smoothingFreq = 50.f;
+// Averaging of the Lyapunov exponent, in iterates
+static const float lyapunovIterates = 256.f;
+// Longest orbit period detected, and tolerance on the orbit points
+static const float maxPeriod = 64.f;
+static const float periodTolerance = 1e-4f;
+
+/* Chaotic maps, x is the iterate and y the second coordinate of 2D maps.
+`param` turns the normalized chaos knob into the map parameter,
+`unit` brings the iterate back to [0, 1] for the output,
+`tangent` applies the Jacobian at (x, y) to the tangent vector (u, w).
+*/
+struct LogisticMap {
+	static float_4 param(float_4 p) { return 3.2f + 0.794f * p; }
+	static void init(float_4& x, float_4& y) { x = 0.5f; y = 0.f; }
+	static void iterate(float_4& x, float_4& y, float_4 r) { x = r * x * (1.f - x); }
+	static void tangent(float_4 x, float_4 y, float_4 r, float_4& u, float_4& w) { u *= r * (1.f - 2.f * x); }
+	static float_4 unit(float_4 x, float_4 r) { return x; }
+};
+
+struct TentMap {
+	static float_4 param(float_4 p) { return 1.4f + 0.599f * p; }
+	static void init(float_4& x, float_4& y) { x = 0.4f; y = 0.f; }
+	static void iterate(float_4& x, float_4& y, float_4 mu) { x = mu * simd::fmin(x, 1.f - x); }
+	static void tangent(float_4 x, float_4 y, float_4 mu, float_4& u, float_4& w) { u *= mu; }
+	static float_4 unit(float_4 x, float_4 mu) { return x; }
+};
+
+struct SineMap {
+	static float_4 param(float_4 p) { return 0.8f + 0.1995f * p; }
+	static void init(float_4& x, float_4& y) { x = 0.4f; y = 0.f; }
+	static void iterate(float_4& x, float_4& y, float_4 a) { x = a * simd::sin(float(M_PI) * x); }
+	static void tangent(float_4 x, float_4 y, float_4 a, float_4& u, float_4& w) { u *= float(M_PI) * a * simd::cos(float(M_PI) * x); }
+	static float_4 unit(float_4 x, float_4 a) { return x; }
+};
+
+// Gauss map, also known as the mouse map, alpha = 6.2
+struct GaussMap {
+	static float_4 param(float_4 p) { return -0.7f + 0.5f * p; }
+	static void init(float_4& x, float_4& y) { x = 0.f; y = 0.f; }
+	static void iterate(float_4& x, float_4& y, float_4 beta) { x = simd::exp(-6.2f * x * x) + beta; }
+	static void tangent(float_4 x, float_4 y, float_4 beta, float_4& u, float_4& w) { u *= -12.4f * x * simd::exp(-6.2f * x * x); }
+	static float_4 unit(float_4 x, float_4 beta) { return x - beta; }
+};
+
+// Henon map, b = 0.3
+struct HenonMap {
+	static float_4 param(float_4 p) { return 1.f + 0.4f * p; }
+	static void init(float_4& x, float_4& y) { x = 0.1f; y = 0.f; }
+	static void iterate(float_4& x, float_4& y, float_4 a) {
+		float_4 nx = 1.f - a * x * x + y;
+		y = 0.3f * x;
+		// Restart an orbit that escaped the attractor
+		float_4 escaped = simd::fabs(nx) > 2.f;
+		x = simd::ifelse(escaped, 0.1f, nx);
+		y = simd::ifelse(escaped, 0.f, y);
+	}
+	static void tangent(float_4 x, float_4 y, float_4 a, float_4& u, float_4& w) {
+		float_4 nu = -2.f * a * x * u + w;
+		w = 0.3f * u;
+		u = nu;
+	}
+	static float_4 unit(float_4 x, float_4 a) { return (x + 1.5f) / 3.f; }
+};
 
 
 struct LogMapOsc : Module {
 	enum ParamIds {
 		FREQ_PARAM,
 		RCVMOD_PARAM,
+		RMOD_PARAM,
 		NUM_PARAMS
 	};
 	enum InputIds {
@@ -14,48 +84,290 @@ struct LogMapOsc : Module {
 	};
 	enum OutputIds {
 		OUT_OUTPUT,
+		LYAPUNOV_OUTPUT,
+		PERIOD_OUTPUT,
 		NUM_OUTPUTS
 	};
 	enum LightIds {
 		NUM_LIGHTS
 	};
 
-	float t = 0.f;
-	//float cycle;
-	float prev, val;
+	int channels = 1;
+	
+	enum Map {
+		LOGISTIC_MAP,
+		TENT_MAP,
+		SINE_MAP,
+		GAUSS_MAP,
+		HENON_MAP,
+		NUM_MAPS
+	};
+	int map = -1;
+	// Smooth the corners between iterates
+	bool bandLimited = true;
+	// Low-pass the chaos modulation
+	bool smoothing = false;
+	// Kernel specialized for the current map and interpolation
+	void (LogMapOsc::*processVoices)(const ProcessArgs& args);
+	// Set from the menu, applied on the audio thread, -1 when nothing is pending
+	int pendingMap = -1;
+	int pendingBandLimited = -1;
+	
+	// Voice state, 4 voices per float_4
+	// Position between two map iterates, in [0, 1)
+	float_4 phase[4] = {};
+	// Map state
+	float_4 x[4];
+	float_4 y[4];
+	// Output of the last two iterates
+	float_4 prev[4];
+	float_4 val[4];
+	// Frequency is only recomputed when the pitch moves
+	float_4 lastPitch[4];
+	float_4 freq[4];
+	// Map parameter is only recomputed when the chaos moves
+	float_4 lastChaos[4];
+	float_4 mapParam[4];
+	float_4 smoothedRmod[4] = {};
+	
+	// Running Lyapunov exponent, from the stretching of a tangent vector
+	float_4 tangentU[4];
+	float_4 tangentW[4];
+	float_4 lyapunov[4];
+	// Brent's cycle detection, with the candidate period confirmed once
+	float_4 cycleLength[4];
+	float_4 cyclePower[4];
+	float_4 cycleStart[4];
+	float_4 cycleCandidate[4];
+	float_4 period[4];
+	blamp::Generator<float_4> blampGenerators[4];
 
 	LogMapOsc() {
 		config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
 		configParam(FREQ_PARAM, -54.f, 54.f, 0.f, "Frequency", " Hz", dsp::FREQ_SEMITONE, dsp::FREQ_C4);
-		configParam(RCVMOD_PARAM, 3.2f, 3.994f, 3.f, "");
-		prev = 0.5f;
-    	val = prev;
+		configParam(RCVMOD_PARAM, 3.2f, 3.994f, 3.f, "Chaos");
+		configParam(RMOD_PARAM, -1.f, 1.f, 1.f, "Chaos modulation", "%", 0.f, 100.f);
+		for (int g=0; g<4; g++)
+		    lastPitch[g] = INFINITY;
+		setMap(LOGISTIC_MAP);
+	}
+	
+	json_t* dataToJson() override {
+		json_t* rootJ = json_object();
+		json_object_set_new(rootJ, "map", json_integer(map));
+		json_object_set_new(rootJ, "bandLimited", json_boolean(bandLimited));
+		json_object_set_new(rootJ, "smoothing", json_boolean(smoothing));
+		return rootJ;
 	}
 
-	void process(const ProcessArgs& args) override {
-		float pitch = params[FREQ_PARAM].getValue() / 12.f;
-		pitch += inputs[PITCH_INPUT].getVoltage();
-		//float freq = dsp::FREQ_C4 * dsp::approxExp2_taylor5(pitch + 30) / 1073741824;	// works only if pitch <= 1.f
-		float freq = dsp::FREQ_C4 * std::pow(2.f, pitch);
-		float cycle = 0.5f / freq;
-		float r = params[RCVMOD_PARAM].getValue();
-
-		t += args.sampleTime;
-	    if (t >= cycle) {
-          t -= cycle;
-          prev = val;
-          val = r * prev *(1.0f - prev);
-        }
-        
-        float l = t / cycle;
-		float value = 2.0f * lerp(prev, val, l) - 1.0f;
+	// Patches from before band-limiting, without the "bandLimited" key or without any data,
+	// keep playing the raw iterates
+	void fromJson(json_t* rootJ) override {
+		setBandLimited(false);
+		Module::fromJson(rootJ);
+	}
 
+	void dataFromJson(json_t* rootJ) override {
+		json_t* mapJ = json_object_get(rootJ, "map");
+		if (mapJ)
+			setMap(json_integer_value(mapJ));
+		json_t* bandLimitedJ = json_object_get(rootJ, "bandLimited");
+		if (bandLimitedJ)
+			setBandLimited(json_boolean_value(bandLimitedJ));
+		json_t* smoothingJ = json_object_get(rootJ, "smoothing");
+		if (smoothingJ)
+			smoothing = json_boolean_value(smoothingJ);
+	}
+	
+	void onReset() override {
+		pendingMap = pendingBandLimited = -1;
+		setMap(LOGISTIC_MAP);
+		setBandLimited(true);
+		smoothing = false;
+	}
+	
+	void setMap(int map) {
+		map = clamp(map, 0, NUM_MAPS - 1);
+		if (map == this->map)
+			return;
+		this->map = map;
+		switch (map) {
+			case TENT_MAP: initMap<TentMap>(); break;
+			case SINE_MAP: initMap<SineMap>(); break;
+			case GAUSS_MAP: initMap<GaussMap>(); break;
+			case HENON_MAP: initMap<HenonMap>(); break;
+			default: initMap<LogisticMap>(); break;
+		}
+	}
+	
+	void setBandLimited(bool bandLimited) {
+		this->bandLimited = bandLimited;
+		for (int g=0; g<4; g++)
+		    blampGenerators[g].reset();
+		switch (map) {
+			case TENT_MAP: selectKernel<TentMap>(); break;
+			case SINE_MAP: selectKernel<SineMap>(); break;
+			case GAUSS_MAP: selectKernel<GaussMap>(); break;
+			case HENON_MAP: selectKernel<HenonMap>(); break;
+			default: selectKernel<LogisticMap>(); break;
+		}
+	}
+	
+	template <class TMap>
+	void initMap() {
+		for (int g=0; g<4; g++) {
+		    TMap::init(x[g], y[g]);
+		    prev[g] = val[g] = TMap::unit(x[g], TMap::param(0.f));
+		    lastChaos[g] = INFINITY;
+		    tangentU[g] = 1.f;
+		    tangentW[g] = 0.f;
+		    lyapunov[g] = 0.f;
+		    cycleLength[g] = 0.f;
+		    cyclePower[g] = 1.f;
+		    cycleStart[g] = val[g];
+		    cycleCandidate[g] = 0.f;
+		    period[g] = 0.f;
+		}
+		selectKernel<TMap>();
+	}
+	
+	template <class TMap>
+	void selectKernel() {
+		if (bandLimited)
+		    processVoices = &LogMapOsc::processMap<TMap, true>;
+		else
+		    processVoices = &LogMapOsc::processMap<TMap, false>;
+	}
 
-		outputs[OUT_OUTPUT].setVoltage((value-0.2f) * 5.f);
+	void process(const ProcessArgs& args) override {
+		int map = pendingMap;
+		if (map >= 0) {
+			pendingMap = -1;
+			setMap(map);
+		}
+		int bandLimited = pendingBandLimited;
+		if (bandLimited >= 0) {
+			pendingBandLimited = -1;
+			setBandLimited(bandLimited);
+		}
+		channels = std::max(1, inputs[PITCH_INPUT].getChannels());
+		outputs[OUT_OUTPUT].setChannels(channels);
+		outputs[LYAPUNOV_OUTPUT].setChannels(channels);
+		outputs[PERIOD_OUTPUT].setChannels(channels);
+		(this->*processVoices)(args);
+	}
+	
+	template <class TMap, bool BANDLIMITED>
+	void processMap(const ProcessArgs& args) {
+		float pitchParam = params[FREQ_PARAM].getValue() / 12.f;
+		// Chaos knob, normalized
+		float chaosParam = clamp((params[RCVMOD_PARAM].getValue() - 3.2f) / 0.794f, 0.f, 1.f);
+		// 10V sweeps the whole range
+		bool modulated = inputs[RMOD_INPUT].isConnected();
+		float rmodDepth = params[RMOD_PARAM].getValue() / 10.f;
+		float smoothingLambda = std::min(1.f, 2.f * float(M_PI) * smoothingFreq * args.sampleTime);
+		bool lyapunovConnected = outputs[LYAPUNOV_OUTPUT].isConnected();
+		bool periodConnected = outputs[PERIOD_OUTPUT].isConnected();
+		
+		for (int c=0; c<channels; c+=4) {
+		    int g = c / 4;
+		    float_4 pitch = pitchParam + inputs[PITCH_INPUT].getVoltageSimd<float_4>(c);
+		    if (simd::movemask(pitch != lastPitch[g])) {
+		        lastPitch[g] = pitch;
+		        freq[g] = approx::voltToFreq(pitch);
+		    }
+		    
+		    float_4 chaos = chaosParam;
+		    if (modulated) {
+		        float_4 rmod = inputs[RMOD_INPUT].getPolyVoltageSimd<float_4>(c);
+		        if (smoothing) {
+		            smoothedRmod[g] += smoothingLambda * (rmod - smoothedRmod[g]);
+		            rmod = smoothedRmod[g];
+		        }
+		        chaos = clamp(chaos + rmodDepth * rmod, 0.f, 1.f);
+		    }
+		    if (simd::movemask(chaos != lastChaos[g])) {
+		        lastChaos[g] = chaos;
+		        mapParam[g] = TMap::param(chaos);
+		    }
+		    
+		    // Two iterates per cycle
+		    float_4 deltaPhase = 2.f * freq[g] * args.sampleTime;
+		    phase[g] += deltaPhase;
+		    float_4 wrap = phase[g] >= 1.f;
+		    int wrapMask = simd::movemask(wrap);
+		    if (wrapMask) {
+		        phase[g] -= simd::ifelse(wrap, simd::floor(phase[g]), 0.f);
+		        float_4 oldSlope = val[g] - prev[g];
+		        if (lyapunovConnected)
+		            updateLyapunov<TMap>(g, wrap);
+		        float_4 nx = x[g];
+		        float_4 ny = y[g];
+		        TMap::iterate(nx, ny, mapParam[g]);
+		        x[g] = simd::ifelse(wrap, nx, x[g]);
+		        y[g] = simd::ifelse(wrap, ny, y[g]);
+		        prev[g] = simd::ifelse(wrap, val[g], prev[g]);
+		        val[g] = simd::ifelse(wrap, TMap::unit(x[g], mapParam[g]), val[g]);
+		        if (periodConnected)
+		            updatePeriod(g, wrap);
+		        
+		        if (BANDLIMITED) {
+		            // Zero for the lanes that did not wrap
+		            float_4 corner = (val[g] - prev[g] - oldSlope) * deltaPhase;
+		            // Time since the corner, in samples
+		            float_4 since = phase[g] / deltaPhase;
+		            blampGenerators[g].insertCorner(since, corner, wrapMask);
+		        }
+		    }
+		    
+		    float_4 interpolated = lerp(prev[g], val[g], phase[g]);
+		    if (BANDLIMITED)
+		        interpolated = blampGenerators[g].process(interpolated);
+		    float_4 value = 2.f * interpolated - 1.f;
+		    outputs[OUT_OUTPUT].setVoltageSimd((value - 0.2f) * 5.f, c);
+		    // 10V per nat per iterate, 0.1V per iterate of period
+		    if (lyapunovConnected)
+		        outputs[LYAPUNOV_OUTPUT].setVoltageSimd(clamp(10.f * lyapunov[g], -10.f, 10.f), c);
+		    if (periodConnected)
+		        outputs[PERIOD_OUTPUT].setVoltageSimd(0.1f * period[g], c);
+		}
+	}
+	
+	// Before the iterate, on the lanes which wrapped
+	template <class TMap>
+	void updateLyapunov(int g, float_4 wrap) {
+		float_4 u = tangentU[g];
+		float_4 w = tangentW[g];
+		TMap::tangent(x[g], y[g], mapParam[g], u, w);
+		float_4 norm = simd::sqrt(u * u + w * w);
+		// Restart the tangent vector when it collapsed
+		float_4 collapsed = norm < 1e-20f;
+		float_4 stretch = simd::log(simd::fmax(norm, 1e-20f));
+		lyapunov[g] += simd::ifelse(wrap, (stretch - lyapunov[g]) / lyapunovIterates, 0.f);
+		tangentU[g] = simd::ifelse(wrap, simd::ifelse(collapsed, 1.f, u / norm), tangentU[g]);
+		tangentW[g] = simd::ifelse(wrap, simd::ifelse(collapsed, 0.f, w / norm), tangentW[g]);
+	}
+	
+	// After the iterate, on the lanes which wrapped
+	void updatePeriod(int g, float_4 wrap) {
+		cycleLength[g] += simd::ifelse(wrap, 1.f, 0.f);
+		float_4 match = wrap & (simd::fabs(val[g] - cycleStart[g]) < periodTolerance);
+		period[g] = simd::ifelse(match & (cycleLength[g] == cycleCandidate[g]), cycleLength[g], period[g]);
+		cycleCandidate[g] = simd::ifelse(match, cycleLength[g], cycleCandidate[g]);
+		// No return to the start point yet, move it forward and double the search
+		float_4 move = wrap & ~match & (cycleLength[g] >= cyclePower[g]);
+		cycleStart[g] = simd::ifelse(move, val[g], cycleStart[g]);
+		cyclePower[g] = simd::ifelse(move, 2.f * cyclePower[g], cyclePower[g]);
+		cycleLength[g] = simd::ifelse(match | move, 0.f, cycleLength[g]);
+		// Chaotic, or a period too long to tell
+		float_4 giveUp = cyclePower[g] > maxPeriod;
+		period[g] = simd::ifelse(giveUp, 0.f, period[g]);
+		cycleCandidate[g] = simd::ifelse(giveUp, 0.f, cycleCandidate[g]);
+		cyclePower[g] = simd::ifelse(giveUp, 1.f, cyclePower[g]);
 	}
 
 	// Precise method, which guarantees v = v1 when t = 1.
-	float lerp(float v0, float v1, float t) {
+	float_4 lerp(float_4 v0, float_4 v1, float_4 t) {
 		return (1 - t) * v0 + t * v1;
 	}
 };
@@ -78,6 +390,24 @@ struct LogMapOscWidget : ModuleWidget {
 		addInput(createInputCentered<PJ301MPort>(mm2px(Vec(8.149, 77.487)), module, LogMapOsc::RMOD_INPUT));
 
 		addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(12.7, 112.417)), module, LogMapOsc::OUT_OUTPUT));
+		addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(7.0, 97.0)), module, LogMapOsc::LYAPUNOV_OUTPUT));
+		addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(18.4, 97.0)), module, LogMapOsc::PERIOD_OUTPUT));
+	}
+
+	void appendContextMenu(Menu* menu) override {
+		LogMapOsc* module = dynamic_cast<LogMapOsc*>(this->module);
+		
+		menu->addChild(new MenuSeparator);
+		menu->addChild(createIndexSubmenuItem("Map", {"Logistic", "Tent", "Sine", "Gauss", "Hénon"},
+			[=]() {return module->map;},
+			[=](int map) {module->pendingMap = map;}
+		));
+		menu->addChild(createBoolMenuItem("Band-limited", "",
+			[=]() {return module->bandLimited;},
+			[=](bool bandLimited) {module->pendingBandLimited = bandLimited;}
+		));
+		menu->addChild(createParamSlider(module, LogMapOsc::RMOD_PARAM));
+		menu->addChild(createBoolPtrMenuItem("Smooth chaos modulation", "", &module->smoothing));
 	}
 };
 
@@ -1,9 +1,33 @@
 #include "plugin.hpp"
+#include "prng.hpp"
+
+
+// Equal-power crossfade gains, a quarter of a sine
+struct FadeTable {
+	static const int SIZE = 256;
+	float gain[SIZE + 1];
+	
+	FadeTable() {
+		for (int i=0; i<=SIZE; i++)
+			gain[i] = std::sin(0.5f * float(M_PI) * i / SIZE);
+	}
+	
+	// x in [0, 1]
+	float lookup(float x) const {
+		float index = x * SIZE;
+		int i = std::min((int) index, SIZE - 1);
+		float f = index - i;
+		return gain[i] + f * (gain[i + 1] - gain[i]);
+	}
+};
+
+static const FadeTable fadeTable;
 
 
 struct PSwitch : Module {
 	enum ParamIds {
 	    ENUMS(PROB_PARAM, 8),
+		FADE_PARAM,
 		NUM_PARAMS
 	};
 	enum InputIds {
@@ -20,48 +44,189 @@ struct PSwitch : Module {
 		NUM_LIGHTS
 	};
 	
-	dsp::SchmittTrigger trigTrigger;
-	int open = 0;
+	dsp::TSchmittTrigger<float_4> trigTriggers[4];
+	int channels = 1;
+	// Selected input of each channel, as floats for the vectorized gather
+	float_4 open[4] = {};
+	// Crossfade level of every input in [0, 1], the open one rises and the others fall,
+	// so a trigger during a fade carries on from the current gains
+	float_4 levels[4][8] = {};
+	// Fade time left, a fade never takes longer than the fade time
+	float_4 fadeLeft[4] = {};
+	
+	prng::Stream stream;
+	prng::AliasTable<8> aliasTable;
+	
+	// Markov chain mode, the next input is drawn from the row of the open one
+	bool markov = false;
+	float matrix[8][8];
+	prng::AliasTable<8> rowTables[8];
 
 	PSwitch() {
 		config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
 		for (int i=0; i<8; i++) {
 		    configParam(PROB_PARAM + i, 0.f, 1.f, 0.5f, "");
 		}
+		configParam(FADE_PARAM, 0.f, 0.1f, 0.f, "Crossfade time", " ms", 0.f, 1000.f);
+		for (int i=0; i<8; i++)
+		    for (int j=0; j<8; j++)
+		        matrix[i][j] = 1.f;
+		for (int g=0; g<4; g++)
+		    levels[g][0] = 1.f;
+	}
+
+	json_t* dataToJson() override {
+		json_t* rootJ = json_object();
+		stream.toJson(rootJ);
+		json_object_set_new(rootJ, "markov", json_boolean(markov));
+		json_t* matrixJ = json_array();
+		for (int i=0; i<8; i++)
+			for (int j=0; j<8; j++)
+				json_array_append_new(matrixJ, json_real(matrix[i][j]));
+		json_object_set_new(rootJ, "matrix", matrixJ);
+		return rootJ;
+	}
+
+	void dataFromJson(json_t* rootJ) override {
+		stream.fromJson(rootJ);
+		json_t* markovJ = json_object_get(rootJ, "markov");
+		if (markovJ)
+			markov = json_boolean_value(markovJ);
+		json_t* matrixJ = json_object_get(rootJ, "matrix");
+		if (matrixJ && json_array_size(matrixJ) == 64) {
+			for (int i=0; i<8; i++)
+				for (int j=0; j<8; j++)
+					matrix[i][j] = clamp((float) json_number_value(json_array_get(matrixJ, 8 * i + j)), 0.f, 1.f);
+		}
+	}
+
+	void onReset() override {
+		stream.restart();
+		markov = false;
+		for (int i=0; i<8; i++)
+		    for (int j=0; j<8; j++)
+		        matrix[i][j] = 1.f;
 	}
 
 	void process(const ProcessArgs& args) override {
-	    if (trigTrigger.process(rescale(inputs[TRIGGER_INPUT].getVoltage(), 0.1f, 2.f, 0.f, 1.f))) {
-	        // Turn led off
-	        lights[SWITCH_LIGHT + open].setBrightness(0.f);
+	    int lastChannels = channels;
+	    channels = std::max(1, inputs[TRIGGER_INPUT].getChannels());
+	    for (int i=0; i<8; i++)
+	        channels = std::max(channels, inputs[IN_INPUT + i].getChannels());
+	    
+	    bool selected = false;
+	    float p[8];
+	    for (int c=0; c<channels; c+=4) {
+	        int g = c / 4;
+	        float_4 trig = trigTriggers[g].process(inputs[TRIGGER_INPUT].getPolyVoltageSimd<float_4>(c), 0.1f, 2.f);
+	        int trigMask = simd::movemask(trig);
+	        if (trigMask == 0)
+	            continue;
+	        
+	        if (!selected) {
+	            for (int i=0; i<8; i++)
+	                p[i] = params[PROB_PARAM + i].getValue();
+	            // Only rebuilt when a probability moved
+	            if (!markov)
+	                aliasTable.update(p);
+	            selected = true;
+	        }
+	        // One draw per triggered channel, keep the current input when every probability is zero
+	        for (int i=0; i<4; i++) {
+	            if (trigMask & (1 << i)) {
+	                int k = markov ? drawTransition((int) open[g][i], p) : aliasTable.sample(stream);
+	                if (k >= 0 && k != open[g][i]) {
+	                    open[g][i] = k;
+	                    fadeLeft[g][i] = 1.f;
+	                }
+	            }
+	        }
+	    }
+	    if (selected || channels != lastChannels)
+	        updateLights();
+	    
+	    float fadeTime = params[FADE_PARAM].getValue();
+	    float fadeStep = (fadeTime > 0.f) ? args.sampleTime / fadeTime : 1.f;
 	    
-	        float p[8] = {
-			    params[PROB_PARAM].getValue(),
-			    params[PROB_PARAM+1].getValue(),
-			    params[PROB_PARAM+2].getValue(),
-			    params[PROB_PARAM+3].getValue(),
-			    params[PROB_PARAM+4].getValue(),
-			    params[PROB_PARAM+5].getValue(),
-			    params[PROB_PARAM+6].getValue()};
-			float sum_p = p[0] + p[1] + p[2] + p[3] + p[4] + p[5] + p[6] + p[7];
-            
-			float r = random::uniform() * sum_p;
-			float cumul = 0.f;
-			for (int i=0; i<8; i++) {
-			    if (r < p[i] + cumul) {
-			        open = i;
-			        break;
-			    }
-			    cumul += p[i];
+	    // Gather the selected input of every channel, 4 at a time
+	    outputs[OUT_OUTPUT].setChannels(channels);
+	    for (int c=0; c<channels; c+=4) {
+	        int g = c / 4;
+	        float_4 out = 0.f;
+	        if (simd::movemask(fadeLeft[g] > 0.f)) {
+	            fadeLeft[g] -= fadeStep;
+	            for (int i=0; i<8; i++) {
+	                float_4 step = simd::ifelse(open[g] == float(i), fadeStep, -fadeStep);
+	                levels[g][i] = simd::clamp(levels[g][i] + step, 0.f, 1.f);
+	                if (!inputs[IN_INPUT + i].isConnected() || !simd::movemask(levels[g][i] > 0.f))
+	                    continue;
+	                float_4 gain;
+	                for (int l=0; l<4; l++)
+	                    gain[l] = fadeTable.lookup(levels[g][i][l]);
+	                out += gain * inputs[IN_INPUT + i].getPolyVoltageSimd<float_4>(c);
+	            }
+	        } else {
+	            for (int i=0; i<8; i++) {
+	                if (inputs[IN_INPUT + i].isConnected())
+	                    out = simd::ifelse(open[g] == float(i), inputs[IN_INPUT + i].getPolyVoltageSimd<float_4>(c), out);
+	            }
+	        }
+	        outputs[OUT_OUTPUT].setVoltageSimd(out, c);
+	    }
+	}
+	
+	// Row weights are scaled by the probability knobs, each row table is
+	// only rebuilt when its weights moved
+	int drawTransition(int from, const float* p) {
+	    float w[8];
+	    for (int i=0; i<8; i++)
+	        w[i] = matrix[from][i] * p[i];
+	    rowTables[from].update(w);
+	    return rowTables[from].sample(stream);
+	}
+	
+	// Brightness follows the share of channels on each input
+	void updateLights() {
+	    int count[8] = {};
+	    for (int c=0; c<channels; c++)
+	        count[(int) open[c / 4][c % 4]]++;
+	    for (int i=0; i<8; i++)
+	        lights[SWITCH_LIGHT + i].setBrightness(count[i] > 0 ? 0.9f * count[i] / channels : 0.f);
+	}
+};
+
+
+// Transition weights, from the row of the open input to each column
+struct MatrixEditor : PaintWidget {
+	PSwitch* module;
+	
+	MatrixEditor() {
+		box.size = Vec(8 * 16, 8 * 16);
+	}
+	
+	void draw(const DrawArgs& args) override {
+		PaintWidget::draw(args);
+		
+		float w = box.size.x / 8;
+		float h = box.size.y / 8;
+		nvgBeginPath(args.vg);
+		for (int i=0; i<8; i++) {
+			for (int j=0; j<8; j++) {
+				float bar = module->matrix[i][j] * (h - 1);
+				nvgRect(args.vg, j * w, (i + 1) * h - 1 - bar, w - 1, bar);
 			}
-			
-			// Turn led on
-			lights[SWITCH_LIGHT + open].setBrightness(0.9f);
 		}
-		
-		float out = inputs[IN_INPUT+open].getVoltage();
-		
-		outputs[OUT_OUTPUT].setVoltage(out);
+		nvgFillColor(args.vg, nvgRGB(0xf0, 0xf0, 0xf0));
+		nvgFill(args.vg);
+	}
+	
+	void paint(Vec pos) override {
+		int i = (int) (pos.y / box.size.y * 8);
+		int j = (int) (pos.x / box.size.x * 8);
+		if (i < 0 || i >= 8 || j < 0 || j >= 8)
+			return;
+		float h = box.size.y / 8;
+		module->matrix[i][j] = clamp((i + 1) - pos.y / h, 0.f, 1.f);
 	}
 };
 
@@ -105,6 +270,22 @@ struct PSwitchWidget : ModuleWidget {
 		addChild(createLight<SmallLight<GreenLight>>(mm2px(Vec(20.4, 89.998)), module, PSwitch::SWITCH_LIGHT + 6));
 		addChild(createLight<SmallLight<GreenLight>>(mm2px(Vec(3.8, 98.747)), module, PSwitch::SWITCH_LIGHT + 7));
 	}
+
+	void appendContextMenu(Menu* menu) override {
+		PSwitch* module = dynamic_cast<PSwitch*>(this->module);
+		
+		menu->addChild(new MenuSeparator);
+		menu->addChild(createParamSlider(module, PSwitch::FADE_PARAM));
+		menu->addChild(createBoolPtrMenuItem("Markov chain", "", &module->markov));
+		if (module->markov) {
+			menu->addChild(createMenuLabel("Transitions, from row to column"));
+			MatrixEditor* editor = new MatrixEditor;
+			editor->module = module;
+			menu->addChild(editor);
+		}
+		
+		prng::appendSeedMenu(menu, &module->stream);
+	}
 };
 
 
@@ -1,18 +1,122 @@
 #include "plugin.hpp"
-#include <samplerate.h>
+#include "prng.hpp"
+#include "delayline.hpp"
+#include "oversample.hpp"
+#include "approx.hpp"
 
 
-#define HISTORY_SIZE (1<<12)
+#define HISTORY_SIZE (1<<13)
+#define CONTROL_BLOCK 32
+
+
+/* Tape motion in [-1, 1], stepped at control rate:
+- wow, 3 slow sines whose speed wanders, driven by noise low-passed at 0.3 Hz
+- flutter, 2 faster sines, wandering the same way
+- scrape flutter, low-passed noise, as fast as the control rate allows
+All the frequencies scale with the speed. T is float for the motion shared by all the channels, float_4 for the own
+motions of 4 channels.
+*/
+static const int MOTION_SINES = 5;
+static const float motionFreqs[MOTION_SINES] = {0.55f, 0.9f, 1.35f, 6.5f, 10.3f};
+// The pitch deviation grows with the frequency, flutter and scrape are kept small
+static const float motionAmps[MOTION_SINES] = {0.5f, 0.25f, 0.12f, 0.008f, 0.005f};
+static const float jitterFreq = 0.3f;
+static const float jitterDepth = 0.2f;
+static const float scrapeFreq = 120.f;
+static const float scrapeAmp = 0.0003f;
+// Normal deviates used by one step
+static const int MOTION_NOISES = MOTION_SINES + 1;
+
+template <typename T>
+struct TapeMotion {
+	T phases[MOTION_SINES];
+	// Low-passed noises of unit variance
+	T jitters[MOTION_SINES];
+	T scrape = 0.f;
+	
+	void init(const T* uniforms) {
+		for (int i=0; i<MOTION_SINES; i++) {
+			phases[i] = uniforms[i];
+			jitters[i] = 0.f;
+		}
+		scrape = 0.f;
+	}
+	
+	// One-pole coefficient for a corner in cycles per step, and the input gain that
+	// keeps the noise level whatever the corner
+	static void noiseFilter(float corner, float& lambda, float& gain) {
+		lambda = std::min(0.9f, 2.f * float(M_PI) * corner);
+		gain = std::sqrt((2.f - lambda) / lambda);
+	}
+	
+	// speed scales every frequency, dt is the control period
+	T step(const T* normals, float speed, float dt) {
+		float lambda, gain;
+		noiseFilter(jitterFreq * speed * dt, lambda, gain);
+		T out = 0.f;
+		for (int i=0; i<MOTION_SINES; i++) {
+			jitters[i] += lambda * (gain * normals[i] - jitters[i]);
+			phases[i] += motionFreqs[i] * speed * dt * (1.f + jitterDepth * jitters[i]);
+			phases[i] -= simd::floor(phases[i]);
+			out += motionAmps[i] * simd::sin(2.f * float(M_PI) * phases[i]);
+		}
+		noiseFilter(scrapeFreq * speed * dt, lambda, gain);
+		scrape += lambda * (gain * normals[MOTION_SINES] - scrape);
+		out += scrapeAmp * scrape;
+		return simd::fmin(simd::fmax(out, -1.f), 1.f);
+	}
+};
+
+/* Tape color for 4 channels: a soft saturation at 2x, then the head bump
+(a peak around 90 Hz) and the high frequency rolloff of the playback head.
+The filter coefficients are set by the module, only when they change.
+The stage always runs, so its latency doesn't depend on the color: at mix 0
+the saturation and the rolloff are mixed out and the bump is flat.
+*/
+struct TapeColor {
+	oversample::HalfBandInterpolator<float_4> upsampler;
+	oversample::HalfBandDecimator<float_4> decimator;
+	dsp::TBiquadFilter<float_4> headBump;
+	dsp::TBiquadFilter<float_4> rolloff;
+	
+	void reset() {
+		upsampler.reset();
+		decimator.reset();
+		headBump.reset();
+		rolloff.reset();
+	}
+	
+	// Rational tanh, exact slope at 0 and saturates at +-1 from +-3
+	static float_4 saturate(float_4 x) {
+		x = simd::clamp(x, -3.f, 3.f);
+		return x * (27.f + x * x) / (27.f + 9.f * x * x);
+	}
+	
+	// Unity gain for quiet signals, 5V peaks are squashed harder with the drive
+	float_4 process(float_4 in, float drive, float mix) {
+		float_4 up[2];
+		upsampler.process(in, up);
+		for (int i=0; i<2; i++)
+			up[i] += mix * (saturate(up[i] * (drive / 5.f)) * (5.f / drive) - up[i]);
+		float_4 out = headBump.process(decimator.process(up[0], up[1]));
+		return out + mix * (rolloff.process(out) - out);
+	}
+};
+
 
 struct Wobble : Module {
 	enum ParamIds {
 		RATE_PARAM,
 		DEPTH_PARAM,
 		COLOR_PARAM,
+		DECORRELATION_PARAM,
+		LATENCY_PARAM,
 		NUM_PARAMS
 	};
 	enum InputIds {
 		IN_INPUT,
+		RATE_INPUT,
+		DEPTH_INPUT,
 		NUM_INPUTS
 	};
 	enum OutputIds {
@@ -26,77 +130,198 @@ struct Wobble : Module {
 	
 	const float max_depth = (float) (1<<12);
 	
-	dsp::DoubleRingBuffer<float, HISTORY_SIZE> historyBuffer;
-	dsp::DoubleRingBuffer<float, 16> outBuffer;
-	SRC_STATE* src;
-	float rate;
-	float depth;
-	float color;
+	int channels = 1;
+	// 4 channels per float_4
+	delayline::DelayLine<float_4, HISTORY_SIZE> history[4];
+	int interpolation = delayline::LAGRANGE;
+	// Shortest latency, color stage included. Its round trip is taken off the
+	// delay line read, so it is never below the interpolator support plus the round trip
+	float minLatency = 500.f;
+	// Latency of the first channel in samples, color stage included
+	float latency = 500.f;
+	float color = 0.f;
+	float decorrelation = 0.f;
+	// Per channel, with the depth CV
+	float_4 depths[4] = {};
 	
+	// Tape position in [0, 1], interpolated over a control block
+	int controlIndex = CONTROL_BLOCK;
+	TapeMotion<float> motion;
+	float delay = 0.5f;
+	float tapeFrom = 0.5f;
+	float tapeTo = 0.5f;
+	// Own motion of each channel, mixed in by the decorrelation
+	TapeMotion<float_4> channelMotions[4];
+	float_4 channelFrom[4];
+	float_4 channelTo[4];
 	
-	float delay = 0.f;   // index in delay buffer
-	float vel = 0.f;
+	TapeColor tapeColors[4];
+	// Color and sample rate of the current filter coefficients
+	float lastColor = -1.f;
+	float lastSampleRate = 0.f;
+	float drive = 1.f;
+	float colorMix = 0.f;
+	
+	prng::Stream stream;
 
 	Wobble() {
 		config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
 		configParam(RATE_PARAM, 0.f, 1.f, 0.1f, "Rate");
 		configParam(DEPTH_PARAM, 0.f, max_depth, max_depth/2, "Depth");
 		configParam(COLOR_PARAM, 0.f, 1.f, 0.f, "Color");
+		configParam(DECORRELATION_PARAM, 0.f, 1.f, 0.f, "Decorrelation between channels", "%", 0.f, 100.f);
+		configParam(LATENCY_PARAM, 0.f, 1000.f, 500.f, "Minimum latency", " samples");
+		paramQuantities[LATENCY_PARAM]->snapEnabled = true;
 		
-		src = src_new(SRC_SINC_FASTEST, 1, NULL);
-		assert(src);
+		initMotion();
+	}
+
+	json_t* dataToJson() override {
+		json_t* rootJ = json_object();
+		stream.toJson(rootJ);
+		json_object_set_new(rootJ, "interpolation", json_integer(interpolation));
+		return rootJ;
+	}
+
+	void dataFromJson(json_t* rootJ) override {
+		stream.fromJson(rootJ);
+		json_t* interpolationJ = json_object_get(rootJ, "interpolation");
+		if (interpolationJ)
+			interpolation = clamp((int) json_integer_value(interpolationJ), 0, delayline::NUM_INTERPOLATIONS - 1);
+	}
+
+	void onReset() override {
+		stream.restart();
+		interpolation = delayline::LAGRANGE;
+		initMotion();
 	}
 	
-	~Wobble() {
-		src_delete(src);
+	// Random starting phases, so the channels do not start in sync
+	void initMotion() {
+		float sharedUniforms[MOTION_SINES];
+		prng::fillUniform(stream, sharedUniforms, MOTION_SINES);
+		motion.init(sharedUniforms);
+		float uniforms[MOTION_SINES * 16];
+		prng::fillUniform(stream, uniforms, MOTION_SINES * 16);
+		for (int g=0; g<4; g++) {
+			float_4 laneUniforms[MOTION_SINES];
+			for (int i=0; i<MOTION_SINES; i++)
+				laneUniforms[i] = float_4::load(&uniforms[(i * 4 + g) * 4]);
+			channelMotions[g].init(laneUniforms);
+			channelFrom[g] = channelTo[g] = 0.5f;
+		}
+		delay = tapeFrom = tapeTo = 0.5f;
+		controlIndex = CONTROL_BLOCK;
 	}
 
 	void process(const ProcessArgs& args) override {
-	    rate = params[RATE_PARAM].getValue() * 1e-8;
-	    depth = params[DEPTH_PARAM].getValue();
-	    color = params[COLOR_PARAM].getValue();
-	    
-	    vel += rate * (0.5 - delay + (random::uniform()*1 - 0.5f));
-	    delay += vel;	    
-	    delay = clamp(delay, 0.f, 1.f);
-        
+	    channels = std::max(1, inputs[IN_INPUT].getChannels());
+	    if (controlIndex == CONTROL_BLOCK) {
+	        updateControl(args);
+	        controlIndex = 0;
+	    }
+	    float t = (float) controlIndex++ / CONTROL_BLOCK;
+	    delay = tapeFrom + t * (tapeTo - tapeFrom);
 	    outputs[DBG_OUTPUT].setVoltage(delay*10.f);
 	    
-	    float dry = inputs[IN_INPUT].getVoltage();
+	    // The lanes only need their own delays when they can differ
+	    bool laneDelays = decorrelation > 0.f || inputs[DEPTH_INPUT].getChannels() > 1;
 	    
-	    if (!historyBuffer.full()) {
-		    historyBuffer.push(dry);
+	    float tape = laneDelays ? channelFrom[0][0] + t * (channelTo[0][0] - channelFrom[0][0]) : delay;
+	    latency = minLatency + tape * depths[0][0];
+	    float readLatency = minLatency - oversample::HALFBAND_ROUND_TRIP;
+	    
+	    outputs[OUT_OUTPUT].setChannels(channels);
+	    for (int c=0; c<channels; c+=4) {
+	        int g = c / 4;
+	        float_4 dry = inputs[IN_INPUT].getVoltageSimd<float_4>(c);
+	        history[g].push(dry);
+	        
+	        // Read the tape position directly, the latency is the delay itself.
+	        // Every input is pushed, the longest delay still fits in the history
+	        float_4 wet;
+	        if (laneDelays) {
+	            float_4 channelTape = channelFrom[g] + t * (channelTo[g] - channelFrom[g]);
+	            wet = history[g].read(readLatency + channelTape * depths[g], interpolation);
+	        } else {
+	            wet = history[g].read(readLatency + delay * depths[g][0], interpolation);
+	        }
+	        wet = tapeColors[g].process(wet, drive, colorMix);
+	        outputs[OUT_OUTPUT].setVoltageSimd(wet, c);
+	    }
+	}
+	
+	// Params, CVs and the next point of the tape motion, once per control block
+	void updateControl(const ProcessArgs& args) {
+		color = params[COLOR_PARAM].getValue();
+		updateColor(args.sampleRate);
+		decorrelation = params[DECORRELATION_PARAM].getValue();
+		minLatency = std::max(std::round(params[LATENCY_PARAM].getValue()), delayline::minDelay(interpolation) + oversample::HALFBAND_ROUND_TRIP);
+		
+		// Rate knob spans 6 octaves around the nominal speed, CV is 1V/oct
+		float speedPitch = 6.f * params[RATE_PARAM].getValue() - 3.f + inputs[RATE_INPUT].getVoltage();
+		float speed = approx::exp2(clamp(speedPitch, -8.f, 6.f));
+		float dt = CONTROL_BLOCK * args.sampleTime;
+		
+		// 10V of CV spans the whole depth
+		float depthParam = params[DEPTH_PARAM].getValue();
+		for (int c=0; c<channels; c+=4) {
+		    float_4 depthCv = inputs[DEPTH_INPUT].getPolyVoltageSimd<float_4>(c);
+		    depths[c / 4] = simd::clamp(depthParam + depthCv * (max_depth / 10.f), 0.f, max_depth);
+		}
+		
+		float normals[MOTION_NOISES];
+		prng::fillNormal(stream, normals, MOTION_NOISES);
+		tapeFrom = tapeTo;
+		tapeTo = 0.5f + 0.5f * motion.step(normals, speed, dt);
+		
+		if (decorrelation > 0.f) {
+		    float laneNormals[MOTION_NOISES * 16];
+		    prng::fillNormal(stream, laneNormals, MOTION_NOISES * 4 * ((channels + 3) / 4));
+		    for (int c=0; c<channels; c+=4) {
+		        int g = c / 4;
+		        float_4 n[MOTION_NOISES];
+		        for (int i=0; i<MOTION_NOISES; i++)
+		            n[i] = float_4::load(&laneNormals[(g * MOTION_NOISES + i) * 4]);
+		        float_4 own = 0.5f + 0.5f * channelMotions[g].step(n, speed, dt);
+		        channelFrom[g] = channelTo[g];
+		        channelTo[g] = tapeTo + decorrelation * (own - tapeTo);
+		    }
+		} else {
+		    // Follow the shared motion, ready for when decorrelation comes back
+		    for (int g=0; g<4; g++) {
+		        channelFrom[g] = tapeFrom;
+		        channelTo[g] = tapeTo;
+		    }
 		}
+	}
+	
+	void updateColor(float sampleRate) {
+		if (color == lastColor && sampleRate == lastSampleRate)
+			return;
+		lastColor = color;
+		lastSampleRate = sampleRate;
 		
-		float index = std::round(500 + delay * depth);
-		// How many samples do we need consume to catch up?
-		float consume = index - historyBuffer.size();
-
-		if (outBuffer.empty()) {
-			double ratio = 1.f;
-			if (std::fabs(consume) >= 16.f) {
-				// Here's where the delay magic is. Smooth the ratio depending on how divergent we are from the correct delay time.
-				ratio = std::pow(10.f, clamp(consume / 10000.f, -1.f, 1.f));
-			}
-
-			SRC_DATA srcData;
-			srcData.data_in = (const float*) historyBuffer.startData();
-			srcData.data_out = (float*) outBuffer.endData();
-			srcData.input_frames = std::min((int) historyBuffer.size(), 16);
-			srcData.output_frames = outBuffer.capacity();
-			srcData.end_of_input = false;
-			srcData.src_ratio = ratio;
-			src_process(src, &srcData);
-			historyBuffer.startIncr(srcData.input_frames_used);
-			outBuffer.endIncr(srcData.output_frames_gen);
+		// The first quarter of the knob fades the stage in
+		colorMix = std::min(4.f * color, 1.f);
+		drive = 1.f + 3.f * color;
+		float bumpGain = std::pow(10.f, 4.f * color / 20.f);
+		float rolloffFreq = std::min(20000.f * std::pow(2.f, -2.f * color), 0.45f * sampleRate);
+		for (int g=0; g<4; g++) {
+			tapeColors[g].headBump.setParameters(dsp::TBiquadFilter<float_4>::PEAK, 90.f / sampleRate, 1.f, bumpGain);
+			tapeColors[g].rolloff.setParameters(dsp::TBiquadFilter<float_4>::LOWPASS, rolloffFreq / sampleRate, 0.707f, 1.f);
 		}
+	}
+};
 
-		float wet = 0.f;
-		if (!outBuffer.empty()) {
-			wet = outBuffer.shift();
-		}
 
-		outputs[OUT_OUTPUT].setVoltage(wet);
+// Updated while the menu is open
+struct LatencyLabel : MenuLabel {
+	Wobble* module;
+	
+	void step() override {
+		text = string::f("Latency: %d samples", (int) std::round(module->latency));
+		MenuLabel::step();
 	}
 };
 
@@ -116,10 +341,26 @@ struct WobbleWidget : ModuleWidget {
 		addParam(createParamCentered<RoundBlackKnob>(mm2px(Vec(7.56, 72.11)), module, Wobble::COLOR_PARAM));
 
 		addInput(createInputCentered<PJ301MPort>(mm2px(Vec(7.62, 98.645)), module, Wobble::IN_INPUT));
+		addInput(createInputCentered<PJ301MPort>(mm2px(Vec(22.86, 33.647)), module, Wobble::RATE_INPUT));
+		addInput(createInputCentered<PJ301MPort>(mm2px(Vec(22.86, 52.878)), module, Wobble::DEPTH_INPUT));
 
 		addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(7.62, 113.475)), module, Wobble::OUT_OUTPUT));
 		addOutput(createOutputCentered<PJ301MPort>(mm2px(Vec(7.62, 85)), module, Wobble::DBG_OUTPUT));
 	}
+
+	void appendContextMenu(Menu* menu) override {
+		Wobble* module = dynamic_cast<Wobble*>(this->module);
+		
+		menu->addChild(new MenuSeparator);
+		menu->addChild(createIndexPtrSubmenuItem("Interpolation", {"Hermite", "Lagrange", "Windowed sinc"}, &module->interpolation));
+		menu->addChild(createParamSlider(module, Wobble::DECORRELATION_PARAM));
+		menu->addChild(createParamSlider(module, Wobble::LATENCY_PARAM));
+		LatencyLabel* latencyLabel = new LatencyLabel;
+		latencyLabel->module = module;
+		menu->addChild(latencyLabel);
+		
+		prng::appendSeedMenu(menu, &module->stream);
+	}
 };
 
 
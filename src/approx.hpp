@@ -0,0 +1,53 @@
+#pragma once
+#include <rack.hpp>
+
+
+using namespace rack;
+
+/* Fast pitch to frequency conversion, shared by the oscillators.
+
+2^x is split into its integer part, written straight into the float
+exponent, and its fractional part, approximated by a degree 5 polynomial
+fitted on Chebyshev nodes over [0, 1).
+Max relative error is 1.79e-7 (0.0003 cents), about float precision,
+checked by bench/exp2.cpp.
+*/
+namespace approx {
+
+static const float EXP2_C0 = 0.999999898350024f;
+static const float EXP2_C1 = 0.6931544896632359f;
+static const float EXP2_C2 = 0.24014181820141742f;
+static const float EXP2_C3 = 0.05586033707730399f;
+static const float EXP2_C4 = 0.008949590423281677f;
+static const float EXP2_C5 = 0.0018937540582229964f;
+
+template <typename T>
+T exp2Fraction(T f) {
+	return EXP2_C0 + f * (EXP2_C1 + f * (EXP2_C2 + f * (EXP2_C3 + f * (EXP2_C4 + f * EXP2_C5))));
+}
+
+inline float exp2(float x) {
+	x = std::min(std::max(x, -126.f), 126.f);
+	// Truncation rounds towards zero, step down for negative fractions
+	int32_t xi = (int32_t) x;
+	xi -= (x < xi);
+	int32_t bits = (xi + 127) << 23;
+	float scale;
+	std::memcpy(&scale, &bits, sizeof(scale));
+	return exp2Fraction(x - xi) * scale;
+}
+
+inline float_4 exp2(float_4 x) {
+	x = simd::clamp(x, -126.f, 126.f);
+	float_4 xi = simd::floor(x);
+	__m128i bits = _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(xi.v), _mm_set1_epi32(127)), 23);
+	return exp2Fraction(x - xi) * float_4(_mm_castsi128_ps(bits));
+}
+
+// V/Oct to Hz, 0V is C4
+template <typename T>
+T voltToFreq(T pitch) {
+	return dsp::FREQ_C4 * exp2(pitch);
+}
+
+} // namespace approx
@@ -0,0 +1,49 @@
+#include "blamp.hpp"
+
+
+namespace blamp {
+
+
+Table::Table() {
+	const int Z = BLAMP_ZERO_CROSSINGS;
+	// Integrate at a finer step than the table
+	const int STEPS = 16;
+	const double dt = 1.0 / (BLAMP_OVERSAMPLE * STEPS);
+	// Cutoff a bit below Nyquist
+	const double fc = 0.45;
+
+	double step = 0.0;
+	double ramp = 0.0;
+	double h0 = 0.0;
+	double s0 = 0.0;
+	double ramps[BLAMP_SIZE + 1];
+	ramps[0] = 0.0;
+	for (int i = 1; i <= BLAMP_SIZE * STEPS; i++) {
+		double t = i * dt - Z;
+		// Blackman-Harris windowed sinc
+		double x = 2.0 * fc * t;
+		double sinc = (x == 0.0) ? 1.0 : std::sin(M_PI * x) / (M_PI * x);
+		double w = 2.0 * M_PI * (t + Z) / (2 * Z);
+		double window = 0.35875 - 0.48829 * std::cos(w) + 0.14128 * std::cos(2 * w) - 0.01168 * std::cos(3 * w);
+		double h = 2.0 * fc * sinc * window;
+		step += 0.5 * (h0 + h) * dt;
+		ramp += 0.5 * (s0 + step) * dt;
+		h0 = h;
+		s0 = step;
+		if (i % STEPS == 0)
+			ramps[i / STEPS] = ramp;
+	}
+
+	// Normalize the step to 1, and remove the ideal ramp
+	for (int i = 0; i <= BLAMP_SIZE; i++) {
+		double t = (double) i / BLAMP_OVERSAMPLE - Z;
+		residual[i] = ramps[i] / step - std::max(t, 0.0);
+	}
+	residual[0] = 0.f;
+	residual[BLAMP_SIZE] = 0.f;
+}
+
+
+const Table table;
+
+} // namespace blamp
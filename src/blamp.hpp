@@ -0,0 +1,95 @@
+#pragma once
+#include <rack.hpp>
+
+
+using namespace rack;
+
+/* Band-limited corners for piecewise linear signals.
+
+A change of slope is smoothed by adding a BLAMP residual, the difference
+between the twice integrated windowed sinc and the ideal ramp. The kernel
+is linear phase, so the residual starts BLAMP_ZERO_CROSSINGS samples before
+the corner: the signal is delayed by as much to make room for it.
+The residual is tabulated at BLAMP_OVERSAMPLE points per sample.
+*/
+namespace blamp {
+
+static const int BLAMP_ZERO_CROSSINGS = 8;
+static const int BLAMP_OVERSAMPLE = 32;
+static const int BLAMP_SIZE = 2 * BLAMP_ZERO_CROSSINGS * BLAMP_OVERSAMPLE;
+
+
+// Residual at t samples from the start of the kernel is residual[t * BLAMP_OVERSAMPLE],
+// t in [0, 2 * BLAMP_ZERO_CROSSINGS], linearly interpolated
+struct Table {
+	float residual[BLAMP_SIZE + 1];
+
+	Table();
+};
+
+extern const Table table;
+
+
+// Delays a signal by BLAMP_ZERO_CROSSINGS samples and smooths its corners.
+// T can be float_4, for 4 voices at once.
+template <typename T>
+struct Generator {
+	static const int Z = BLAMP_ZERO_CROSSINGS;
+	T correction[2 * Z];
+	T delay[Z];
+	int pos = 0;
+
+	Generator() {
+		reset();
+	}
+
+	void reset() {
+		for (int i = 0; i < 2 * Z; i++)
+			correction[i] = 0.f;
+		for (int i = 0; i < Z; i++)
+			delay[i] = 0.f;
+		pos = 0;
+	}
+
+	/* Adds a change of slope per lane, in signal units per sample, which happened
+	p samples before the sample about to be processed, p in [0, 1).
+	Only the lanes set in mask, as from simd::movemask(), are inserted, all in one pass.
+	*/
+	void insertCorner(float_4 p, float_4 slope, int mask) {
+		mask &= simd::movemask((p >= 0.f) & (p < 1.f));
+		if (!mask)
+			return;
+		// The fraction is the same for every tap, only the table row moves
+		int index[4];
+		float_4 frac = 0.f;
+		float_4 amount = 0.f;
+		for (int i = 0; i < 4; i++) {
+			index[i] = 0;
+			if (mask & (1 << i)) {
+				float t = p[i] * BLAMP_OVERSAMPLE;
+				index[i] = (int) t;
+				frac[i] = t - index[i];
+				amount[i] = slope[i];
+			}
+		}
+		for (int j = 0; j < 2 * Z; j++) {
+			float_4 r0, r1;
+			for (int i = 0; i < 4; i++) {
+				const float* r = &table.residual[j * BLAMP_OVERSAMPLE + index[i]];
+				r0[i] = r[0];
+				r1[i] = r[1];
+			}
+			correction[(pos + j) & (2 * Z - 1)] += amount * (r0 + frac * (r1 - r0));
+		}
+	}
+
+	T process(T in) {
+		T out = delay[pos & (Z - 1)] + correction[pos];
+		delay[pos & (Z - 1)] = in;
+		correction[pos] = 0.f;
+		pos = (pos + 1) & (2 * Z - 1);
+		return out;
+	}
+};
+
+} // namespace blamp
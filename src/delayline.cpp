@@ -0,0 +1,72 @@
+#include "delayline.hpp"
+
+
+namespace delayline {
+
+
+// Zeroth order modified Bessel function, for the Kaiser window
+static double besselI0(double x) {
+	double sum = 1.0;
+	double term = 1.0;
+	for (int k = 1; k < 32; k++) {
+		term *= (x / (2 * k)) * (x / (2 * k));
+		sum += term;
+	}
+	return sum;
+}
+
+
+Kernels::Kernels() {
+	std::memset(taps, 0, sizeof(taps));
+
+	for (int p = 0; p <= PHASES; p++) {
+		// Fractional delay, the point read is between the center tap and the next older one
+		double f = (double) p / PHASES;
+
+		// Hermite
+		float* h = taps[HERMITE][p];
+		h[0] = -0.5 * f + f * f - 0.5 * f * f * f;
+		h[1] = 1.0 - 2.5 * f * f + 1.5 * f * f * f;
+		h[2] = 0.5 * f + 2.0 * f * f - 1.5 * f * f * f;
+		h[3] = -0.5 * f * f + 0.5 * f * f * f;
+
+		// Lagrange, the nodes are at N / 2 - 1 - k, the point at -f
+		const int NL = TAPS[LAGRANGE];
+		h = taps[LAGRANGE][p];
+		for (int k = 0; k < NL; k++) {
+			double tk = NL / 2 - 1 - k;
+			double w = 1.0;
+			for (int j = 0; j < NL; j++) {
+				if (j == k)
+					continue;
+				double tj = NL / 2 - 1 - j;
+				w *= (-f - tj) / (tk - tj);
+			}
+			h[k] = w;
+		}
+
+		// Windowed sinc, normalized to unit DC gain
+		const int NS = TAPS[SINC];
+		const double fc = 0.9;
+		const double beta = 8.0;
+		h = taps[SINC][p];
+		double sum = 0.0;
+		double hs[MAX_TAPS];
+		for (int k = 0; k < NS; k++) {
+			double d = NS / 2 - 1 - k + f;
+			double x = fc * d;
+			double sinc = (x == 0.0) ? 1.0 : std::sin(M_PI * x) / (M_PI * x);
+			double r = d / (NS / 2);
+			double window = (std::fabs(r) < 1.0) ? besselI0(beta * std::sqrt(1.0 - r * r)) / besselI0(beta) : 0.0;
+			hs[k] = sinc * window;
+			sum += hs[k];
+		}
+		for (int k = 0; k < NS; k++)
+			h[k] = hs[k] / sum;
+	}
+}
+
+
+const Kernels kernels;
+
+} // namespace delayline
@@ -0,0 +1,121 @@
+#pragma once
+#include <rack.hpp>
+#include "history.hpp"
+
+
+using namespace rack;
+
+/* Modulated fractional delay line.
+
+The taps of every interpolation are tabulated at PHASES + 1 fractional
+delays, and linearly interpolated between them:
+- Hermite, 4 point cubic (Catmull-Rom)
+- Lagrange, 6 point, 5th order
+- windowed sinc, 16 points, Kaiser window (beta 8), cutoff 0.9 Nyquist
+A read at delay D needs the samples up to D - TAPS / 2 + 1, so the shortest
+delay is minDelay() and grows with the number of taps.
+*/
+namespace delayline {
+
+enum Interpolation {
+	HERMITE,
+	LAGRANGE,
+	SINC,
+	NUM_INTERPOLATIONS
+};
+
+static const int MAX_TAPS = 16;
+static const int PHASES = 256;
+static const int TAPS[NUM_INTERPOLATIONS] = {4, 6, 16};
+
+
+struct Kernels {
+	// Newest sample first
+	float taps[NUM_INTERPOLATIONS][PHASES + 1][MAX_TAPS];
+
+	Kernels();
+};
+
+extern const Kernels kernels;
+
+
+inline float minDelay(int interpolation) {
+	return TAPS[interpolation] / 2 - 1;
+}
+
+
+// T can be float_4, to delay 4 channels at once
+template <typename T, int SIZE>
+struct DelayLine {
+	history::Buffer<T, SIZE> buffer;
+
+	void reset() {
+		buffer.reset();
+	}
+
+	void push(T in) {
+		buffer.push(in);
+	}
+
+	static float maxDelay() {
+		return SIZE - MAX_TAPS;
+	}
+
+	// Delay in samples, 0 is the last pushed sample
+	T read(float delay, int interpolation) {
+		switch (interpolation) {
+			case HERMITE: return readTaps<4>(delay, kernels.taps[HERMITE]);
+			case LAGRANGE: return readTaps<6>(delay, kernels.taps[LAGRANGE]);
+			default: return readTaps<16>(delay, kernels.taps[SINC]);
+		}
+	}
+
+	template <int N>
+	T readTaps(float delay, const float (*taps)[MAX_TAPS]) {
+		delay = clamp(delay, N / 2 - 1.f, maxDelay());
+		int delayInt = (int) delay;
+		float phase = (delay - delayInt) * PHASES;
+		int phaseInt = std::min((int) phase, PHASES - 1);
+		float phaseFrac = phase - phaseInt;
+		const float* h0 = taps[phaseInt];
+		const float* h1 = taps[phaseInt + 1];
+		// w[0] is the newest sample under the kernel, the taps go back from there
+		const T* w = buffer.window(delayInt - N / 2 + 2);
+		T y = 0.f;
+		for (int k = 0; k < N; k++)
+			y += (h0[k] + phaseFrac * (h1[k] - h0[k])) * w[-k];
+		return y;
+	}
+
+	// One delay per lane, for T = float_4. The taps differ per lane, so this
+	// is 4 scalar reads: use the shared delay read whenever the lanes agree.
+	T read(float_4 delay, int interpolation) {
+		switch (interpolation) {
+			case HERMITE: return readLanes<4>(delay, kernels.taps[HERMITE]);
+			case LAGRANGE: return readLanes<6>(delay, kernels.taps[LAGRANGE]);
+			default: return readLanes<16>(delay, kernels.taps[SINC]);
+		}
+	}
+
+	template <int N>
+	T readLanes(float_4 delay, const float (*taps)[MAX_TAPS]) {
+		T y;
+		for (int i = 0; i < 4; i++) {
+			float d = clamp(delay[i], N / 2 - 1.f, maxDelay());
+			int delayInt = (int) d;
+			float phase = (d - delayInt) * PHASES;
+			int phaseInt = std::min((int) phase, PHASES - 1);
+			float phaseFrac = phase - phaseInt;
+			const float* h0 = taps[phaseInt];
+			const float* h1 = taps[phaseInt + 1];
+			const T* w = buffer.window(delayInt - N / 2 + 2);
+			float yi = 0.f;
+			for (int k = 0; k < N; k++)
+				yi += (h0[k] + phaseFrac * (h1[k] - h0[k])) * w[-k][i];
+			y[i] = yi;
+		}
+		return y;
+	}
+};
+
+} // namespace delayline
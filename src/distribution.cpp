@@ -0,0 +1,155 @@
+#include "distribution.hpp"
+
+
+namespace distribution {
+
+
+// Table knots are at i/TABLE_SIZE, the infinite end points are pulled in by half a step
+static double knot(int i) {
+	double u = (double) i / TABLE_SIZE;
+	return std::min(std::max(u, 0.5 / TABLE_SIZE), 1.0 - 0.5 / TABLE_SIZE);
+}
+
+
+StandardTables::StandardTables() {
+	for (int i = 0; i <= TABLE_SIZE; i++) {
+		double u = knot(i);
+
+		// Normal, bisection on the CDF
+		double lo = -10.0;
+		double hi = 10.0;
+		for (int j = 0; j < 60; j++) {
+			double mid = 0.5 * (lo + hi);
+			if (0.5 * std::erfc(-mid / M_SQRT2) < u)
+				lo = mid;
+			else
+				hi = mid;
+		}
+		normal.table[i] = 0.5 * (lo + hi);
+
+		// Laplace with unit variance
+		double l = (u < 0.5) ? std::log(2.0 * u) : -std::log(2.0 * (1.0 - u));
+		laplace.table[i] = l / M_SQRT2;
+
+		// Cauchy
+		cauchy.table[i] = std::tan(M_PI * (u - 0.5));
+
+		double z = -8.0 + 16.0 * i / TABLE_SIZE;
+		normalCdf.table[i] = 0.5 * std::erfc(-z / M_SQRT2);
+
+		// Inverse of cdfPosition(), the end points are the limits
+		double w = 2.0 * i / TABLE_SIZE - 1.0;
+		if (i == 0 || i == TABLE_SIZE) {
+			normalBounds.table[i] = laplaceBounds.table[i] = cauchyBounds.table[i] = 0.5 * (w + 1.0);
+			continue;
+		}
+		double x = w / (1.0 - std::fabs(w));
+		normalBounds.table[i] = 0.5 * std::erfc(-x / M_SQRT2);
+		// Laplace with unit variance
+		double y = x * M_SQRT2;
+		laplaceBounds.table[i] = (y < 0.0) ? 0.5 * std::exp(y) : 1.0 - 0.5 * std::exp(-y);
+		cauchyBounds.table[i] = 0.5 + std::atan(x) / M_PI;
+	}
+}
+
+
+const StandardTables standardTables;
+
+
+float tailQuantile(int shape, float p) {
+	// Away from 0 and 1, where the quantiles are infinite
+	p = clamp(p, 1e-30f, 1.f - 6e-8f);
+	float lower = std::min(p, 1.f - p);
+	float sign = (p < 0.5f) ? -1.f : 1.f;
+	switch (shape) {
+		case LAPLACE: {
+			return -sign * std::log(2.f * lower) / float(M_SQRT2);
+		}
+		case CAUCHY: {
+			return sign / std::tan(float(M_PI) * lower);
+		}
+		default: {
+			// Acklam's rational approximation of the lower tail, relative error 1.15e-9
+			float q = std::sqrt(-2.f * std::log(lower));
+			float num = ((((-7.784894002430293e-03f * q - 3.223964580411365e-01f) * q - 2.400758277161838e+00f) * q
+				- 2.549732539343734e+00f) * q + 4.374664141464968e+00f) * q + 2.938163982698783e+00f;
+			float den = (((7.784695709041462e-03f * q + 3.224671290700398e-01f) * q + 2.445134137142996e+00f) * q
+				+ 3.754408661907416e+00f) * q + 1.f;
+			return -sign * num / den;
+		}
+	}
+}
+
+
+Drawn::Drawn() {
+	reset();
+	build();
+}
+
+
+void Drawn::reset() {
+	// Start with a triangle, so the drawn shape is visibly not a normal
+	for (int i = 0; i < DRAWN_BINS; i++) {
+		float x = (i + 0.5f) / DRAWN_BINS;
+		density[i] = 1.f - std::fabs(2.f * x - 1.f);
+	}
+}
+
+
+void Drawn::build() {
+	float sum = 0.f;
+	for (int i = 0; i < DRAWN_BINS; i++)
+		sum += std::max(density[i], 0.f);
+
+	cdf[0] = 0.f;
+	for (int i = 0; i < DRAWN_BINS; i++) {
+		// An empty drawing falls back to a uniform density
+		float d = (sum > 0.f) ? std::max(density[i], 0.f) / sum : 1.f / DRAWN_BINS;
+		cdf[i + 1] = cdf[i] + d;
+	}
+	cdf[DRAWN_BINS] = 1.f;
+
+	// Invert the piecewise linear CDF
+	const float binWidth = 2.f * DRAWN_RANGE / DRAWN_BINS;
+	int bin = 0;
+	for (int i = 0; i <= TABLE_SIZE; i++) {
+		float u = (float) i / TABLE_SIZE;
+		while (bin < DRAWN_BINS - 1 && cdf[bin + 1] <= u)
+			bin++;
+		float width = cdf[bin + 1] - cdf[bin];
+		float frac = (width > 0.f) ? (u - cdf[bin]) / width : 0.f;
+		quantiles.table[i] = -DRAWN_RANGE + (bin + clamp(frac, 0.f, 1.f)) * binWidth;
+	}
+}
+
+
+void Correlation::update(int size, float rho) {
+	// Equicorrelation is positive definite for -1/(size-1) < rho < 1
+	float rhoMin = (size > 1) ? -1.f / (size - 1) + 1e-3f : 0.f;
+	rho = clamp(rho, rhoMin, 0.999f);
+	if (size == this->size && rho == this->rho)
+		return;
+	this->size = size;
+	this->rho = rho;
+
+	// Cholesky-Banachiewicz, L is written transposed
+	double l[16][16] = {};
+	for (int i = 0; i < size; i++) {
+		for (int j = 0; j <= i; j++) {
+			double sum = (i == j) ? 1.0 : rho;
+			for (int k = 0; k < j; k++)
+				sum -= l[i][k] * l[j][k];
+			if (i == j)
+				l[i][j] = std::sqrt(std::max(sum, 1e-9));
+			else
+				l[i][j] = sum / l[j][j];
+		}
+	}
+	for (int i = 0; i < 16; i++) {
+		for (int j = 0; j < 16; j++)
+			lt[j][i] = l[i][j];
+	}
+}
+
+
+} // namespace distribution
@@ -0,0 +1,219 @@
+#pragma once
+#include <rack.hpp>
+
+
+using namespace rack;
+
+/* Inverse-CDF sampling of the Gaussian module distributions.
+
+Every shape is tabulated once as the quantile function of its standard form.
+Truncating it to the output range only needs the CDF at the two bounds,
+which depends on sigma alone and is cached per voice. The CDFs are tabulated
+too, so a moving sigma costs two more lookups. Drawing a value is then
+one uniform and one table lookup, whatever the shape. The first and last
+steps of the analytic shapes use their closed forms instead, so the tails
+are not cut off at the end knots of the tables.
+*/
+namespace distribution {
+
+enum Shape {
+	NORMAL,
+	LAPLACE,
+	CAUCHY,
+	DRAWN,
+	NUM_SHAPES
+};
+
+static const int TABLE_SIZE = 1024;
+static const int DRAWN_BINS = 32;
+// The drawn density spans [-DRAWN_RANGE, DRAWN_RANGE] sigmas
+static const float DRAWN_RANGE = 3.f;
+// Probabilities below TAIL or above 1 - TAIL skip the quantile tables
+static const float TAIL = 1.f / TABLE_SIZE;
+
+
+// Linearly interpolated table over [0, 1]
+struct Table {
+	float table[TABLE_SIZE + 1];
+
+	float lookup(float p) const {
+		float pos = clamp(p, 0.f, 1.f) * TABLE_SIZE;
+		int i = std::min((int) pos, TABLE_SIZE - 1);
+		float frac = pos - i;
+		return table[i] + (table[i + 1] - table[i]) * frac;
+	}
+};
+
+// Quantiles of the analytic shapes, built when the plugin is loaded
+struct StandardTables {
+	Table normal;
+	Table laplace;
+	Table cauchy;
+	// Standard normal CDF over [-8, 8]
+	Table normalCdf;
+	// CDFs over the whole real line, see cdfPosition()
+	Table normalBounds;
+	Table laplaceBounds;
+	Table cauchyBounds;
+	StandardTables();
+};
+
+extern const StandardTables standardTables;
+
+// Quantile of an analytic shape in its tails, where the table end knots are pulled in
+// by half a step and would stop the normal at 3.3 sigmas
+float tailQuantile(int shape, float p);
+
+inline float normalCdf(float z) {
+	return standardTables.normalCdf.lookup((z + 8.f) / 16.f);
+}
+
+// x / (1 + |x|) maps the real line to (-1, 1), then to a table position
+inline float_4 cdfPosition(float_4 x) {
+	return 0.5f + 0.5f * x / (1.f + simd::fabs(x));
+}
+
+
+// Piecewise constant density, as drawn by the user
+struct Drawn {
+	float density[DRAWN_BINS];
+	float cdf[DRAWN_BINS + 1];
+	Table quantiles;
+
+	Drawn();
+	// Back to the default triangle, build() must follow
+	void reset();
+	void build();
+
+	float cdfAt(float x) const {
+		float pos = (x + DRAWN_RANGE) / (2.f * DRAWN_RANGE) * DRAWN_BINS;
+		if (pos <= 0.f)
+			return 0.f;
+		if (pos >= DRAWN_BINS)
+			return 1.f;
+		int i = (int) pos;
+		return cdf[i] + (cdf[i + 1] - cdf[i]) * (pos - i);
+	}
+};
+
+
+struct Engine {
+	int shape = NORMAL;
+	bool unipolar = false;
+	Drawn drawn;
+
+	// Truncation window of each voice, in probability space
+	float cachedSigma[16];
+	float lo[16];
+	float span[16];
+
+	Engine() {
+		invalidate();
+	}
+
+	void invalidate() {
+		for (int i = 0; i < 16; i++)
+			cachedSigma[i] = -1.f;
+	}
+
+	void setShape(int shape, bool unipolar) {
+		if (shape == this->shape && unipolar == this->unipolar)
+			return;
+		this->shape = shape;
+		this->unipolar = unipolar;
+		invalidate();
+	}
+
+	void rebuildDrawn() {
+		drawn.build();
+		if (shape == DRAWN)
+			invalidate();
+	}
+
+	const Table& quantiles() const {
+		switch (shape) {
+			case LAPLACE: return standardTables.laplace;
+			case CAUCHY: return standardTables.cauchy;
+			case DRAWN: return drawn.quantiles;
+			default: return standardTables.normal;
+		}
+	}
+
+	// Quantile of the standard shape, q is quantiles()
+	float quantile(const Table& q, float p) const {
+		if (shape != DRAWN && (p < TAIL || p > 1.f - TAIL))
+			return tailQuantile(shape, p);
+		return q.lookup(p);
+	}
+
+	// CDF of the standard shape
+	float_4 cdf(float_4 x) const {
+		float_4 p;
+		if (shape == DRAWN) {
+			for (int i = 0; i < 4; i++)
+				p[i] = drawn.cdfAt(x[i]);
+			return p;
+		}
+		const Table& t = (shape == LAPLACE) ? standardTables.laplaceBounds :
+			(shape == CAUCHY) ? standardTables.cauchyBounds : standardTables.normalBounds;
+		float_4 pos = cdfPosition(x);
+		for (int i = 0; i < 4; i++)
+			p[i] = t.lookup(pos[i]);
+		return p;
+	}
+
+	// Windows of voices c to c+3
+	void updateWindows(int c, float_4 sigma) {
+		sigma.store(&cachedSigma[c]);
+		float_4 s = simd::fmax(sigma, 1e-6f);
+		// Output is clamped to [-0.5, 0.5] around mu, or [0, 1] in unipolar mode
+		float_4 a = unipolar ? float_4(0.f) : -0.5f / s;
+		float_4 b = unipolar ? 1.f / s : 0.5f / s;
+		float_4 cdfA = cdf(a);
+		cdfA.store(&lo[c]);
+		(cdf(b) - cdfA).store(&span[c]);
+	}
+
+	// Uniforms `u` of voices c to c+3 to truncated values around mu
+	float_4 sample(int c, float_4 u, float_4 mu, float_4 sigma) {
+		if (simd::movemask(sigma != float_4::load(&cachedSigma[c])))
+			updateWindows(c, sigma);
+
+		float_4 p = float_4::load(&lo[c]) + u * float_4::load(&span[c]);
+		const Table& q = quantiles();
+		float_4 x;
+		for (int i = 0; i < 4; i++)
+			x[i] = quantile(q, p[i]);
+
+		// Table interpolation can overshoot the bounds by a hair
+		if (unipolar)
+			return mu + simd::clamp(sigma * x, 0.f, 1.f);
+		return mu + simd::clamp(sigma * x, -0.5f, 0.5f);
+	}
+};
+
+
+/* Cholesky factor of an equicorrelation matrix (1 on the diagonal, rho
+everywhere else). It is only recomputed when rho or the size change, the
+factor is stored transposed so that L*n runs on columns of 4 rows.
+*/
+struct Correlation {
+	int size = 0;
+	float rho = 0.f;
+	float lt[16][16] = {};
+
+	void update(int size, float rho);
+
+	// z = L*n, for the first `size` entries
+	void apply(const float* n, float* z) const {
+		for (int r = 0; r < size; r += 4) {
+			float_4 acc = 0.f;
+			int cols = std::min(r + 4, size);
+			for (int j = 0; j < cols; j++)
+				acc += float_4::load(&lt[j][r]) * n[j];
+			acc.store(&z[r]);
+		}
+	}
+};
+
+} // namespace distribution
@@ -0,0 +1,42 @@
+#pragma once
+#include <rack.hpp>
+
+
+using namespace rack;
+
+/* Ring buffer of the last inputs, for FIR filters and delay lines.
+
+Every input is written twice, SIZE apart, so the last SIZE inputs are
+always contiguous and a filter window never wraps. SIZE is a power of 2.
+T can be float_4, to keep 4 channels at once.
+*/
+namespace history {
+
+template <typename T, int SIZE>
+struct Buffer {
+	T x[2 * SIZE];
+	int pos = 0;
+
+	Buffer() {
+		reset();
+	}
+
+	void reset() {
+		for (int i = 0; i < 2 * SIZE; i++)
+			x[i] = 0.f;
+		pos = 0;
+	}
+
+	void push(T in) {
+		x[pos] = in;
+		x[pos + SIZE] = in;
+		pos = (pos + 1) & (SIZE - 1);
+	}
+
+	// The last n inputs, oldest first, n <= SIZE
+	const T* window(int n) const {
+		return &x[pos + SIZE - n];
+	}
+};
+
+} // namespace history
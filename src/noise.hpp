@@ -0,0 +1,145 @@
+#pragma once
+#include <rack.hpp>
+#include "prng.hpp"
+
+
+using namespace rack;
+
+/* Colored gaussian noise for up to 16 voices, all normalized to unit variance.
+
+Noise is generated BLOCK_SIZE frames at a time, 4 voices per float_4 lane,
+so that a colored frame costs about the same as a white one.
+*/
+namespace noise {
+
+enum Color {
+	WHITE,
+	PINK,
+	BROWN,
+	BLUE,
+	NUM_COLORS
+};
+
+static const int BLOCK_SIZE = 16;
+static const int PINK_ROWS = 12;
+// Corner frequency of the brown noise leaky integrator, keeps it centered
+static const float BROWN_CORNER = 20.f;
+
+
+struct ColoredNoise {
+	// Voss-McCartney rows, row k is redrawn every 2^k frames
+	float_4 rows[4][PINK_ROWS];
+	float_4 rowSum[4];
+	float_4 prevPink[4];
+	float_4 brown[4];
+	uint32_t counter = 0;
+	bool seeded = false;
+
+	float white[BLOCK_SIZE][16] = {};
+	float block[BLOCK_SIZE][16] = {};
+	int index = BLOCK_SIZE;
+	// Groups of 4 voices written in the current block
+	int groups = 0;
+
+	template <class TGenerator>
+	void seed(TGenerator& g) {
+		for (int k = 0; k < 4; k++) {
+			rowSum[k] = 0.f;
+			for (int r = 0; r < PINK_ROWS; r++) {
+				float n[4];
+				prng::fillNormal(g, n, 4);
+				rows[k][r] = float_4::load(n);
+				rowSum[k] += rows[k][r];
+			}
+			prevPink[k] = rowSum[k];
+			brown[k] = 0.f;
+		}
+		seeded = true;
+	}
+
+	// Move to the next frame, once per sample.
+	// A block is started early when voices are added, so they never read stale frames
+	template <class TGenerator>
+	void step(TGenerator& g, int color, int channels, float sampleTime) {
+		if (++index >= BLOCK_SIZE || (channels + 3) / 4 > groups) {
+			refill(g, color, channels, sampleTime);
+			index = 0;
+		}
+	}
+
+	// Current frame, voices c to c+3
+	float_4 get(int c) {
+		return float_4::load(&block[index][c]);
+	}
+
+	template <class TGenerator>
+	void refill(TGenerator& g, int color, int channels, float sampleTime) {
+		if (!seeded)
+			seed(g);
+		groups = (channels + 3) / 4;
+		for (int i = 0; i < BLOCK_SIZE; i++)
+			prng::fillNormal(g, white[i], groups * 4);
+
+		switch (color) {
+			case PINK: {
+				const float scale = 1.f / std::sqrt((float) PINK_ROWS + 1);
+				for (int i = 0; i < BLOCK_SIZE; i++) {
+					stepPink(g, groups);
+					for (int k = 0; k < groups; k++)
+						(scale * (rowSum[k] + float_4::load(&white[i][4 * k]))).store(&block[i][4 * k]);
+				}
+			} break;
+			case BLUE: {
+				// Differentiated pink noise, +3dB/octave
+				for (int i = 0; i < BLOCK_SIZE; i++) {
+					stepPink(g, groups);
+					for (int k = 0; k < groups; k++) {
+						float_4 pink = rowSum[k] + float_4::load(&white[i][4 * k]);
+						// One row and the white term change per frame: the difference has variance 4
+						(0.5f * (pink - prevPink[k])).store(&block[i][4 * k]);
+						prevPink[k] = pink;
+					}
+				}
+			} break;
+			case BROWN: {
+				float a = std::exp(-2.f * float(M_PI) * BROWN_CORNER * sampleTime);
+				float b = std::sqrt(1.f - a * a);
+				for (int i = 0; i < BLOCK_SIZE; i++) {
+					for (int k = 0; k < groups; k++) {
+						brown[k] = a * brown[k] + b * float_4::load(&white[i][4 * k]);
+						brown[k].store(&block[i][4 * k]);
+					}
+				}
+			} break;
+			default: {
+				std::memcpy(block, white, sizeof(block));
+			} break;
+		}
+	}
+
+	// Redraw the row picked by the trailing zeros of the frame counter
+	template <class TGenerator>
+	void stepPink(TGenerator& g, int groups) {
+		// Counted modulo 2^PINK_ROWS, 0 ends a cycle in which every row was redrawn
+		counter = (counter + 1) & ((1 << PINK_ROWS) - 1);
+		if (counter == 0) {
+			// Nothing to redraw, sum the rows again so rounding errors don't pile up
+			for (int k = 0; k < groups; k++) {
+				rowSum[k] = 0.f;
+				for (int r = 0; r < PINK_ROWS; r++)
+					rowSum[k] += rows[k][r];
+			}
+			return;
+		}
+		int row = __builtin_ctz(counter);
+		for (int k = 0; k < groups; k++) {
+			float n[4];
+			prng::fillNormal(g, n, 4);
+			float_4 r = float_4::load(n);
+			rowSum[k] += r - rows[k][row];
+			rows[k][row] = r;
+		}
+	}
+};
+
+} // namespace noise
@@ -0,0 +1,83 @@
+#pragma once
+#include <rack.hpp>
+#include "history.hpp"
+
+
+using namespace rack;
+
+/* Half-band FIR filters for 2x oversampling, cascaded for 4x.
+
+Kaiser windowed sinc (beta 8), 47 taps. Every even tap but the center is
+zero, so a 2:1 decimation costs 12 multiplies per output, and a 1:2
+interpolation 12 multiplies per input (its other phase is a pure delay).
+Flat to 0.2 fs (of the oversampled rate), more than 56dB down from 0.3 fs.
+The sample type T can be float_4, to filter 4 voices at once.
+*/
+namespace oversample {
+
+static const int HALFBAND_TAPS = 12;
+static const int HALFBAND_LENGTH = 4 * HALFBAND_TAPS - 1;
+static const float HALFBAND_CENTER = 0.49999539684f;
+// Delay of a 1:2 interpolation followed by a 2:1 decimation, in input samples.
+// The decimator output is aligned with its second input
+static const float HALFBAND_ROUND_TRIP = 2 * HALFBAND_TAPS - 1.5f;
+// Taps at +-1, +-3, +-5... from the center
+static const float HALFBAND_COEFFS[HALFBAND_TAPS] = {
+	3.1606293622e-01f,
+	-9.9534583629e-02f,
+	5.3239599218e-02f,
+	-3.1906212045e-02f,
+	1.9511682587e-02f,
+	-1.1685384108e-02f,
+	6.6708475821e-03f,
+	-3.5394678469e-03f,
+	1.6906510319e-03f,
+	-6.9000360081e-04f,
+	2.1460425686e-04f,
+	-3.2368087846e-05f,
+};
+
+
+template <typename T>
+struct HalfBandDecimator {
+	history::Buffer<T, 64> buffer;
+
+	void reset() {
+		buffer.reset();
+	}
+
+	// Two samples in, one out
+	T process(T in0, T in1) {
+		buffer.push(in0);
+		buffer.push(in1);
+		const T* w = buffer.window(HALFBAND_LENGTH);
+		const int mid = HALFBAND_LENGTH / 2;
+		T y = HALFBAND_CENTER * w[mid];
+		for (int j = 0; j < HALFBAND_TAPS; j++)
+			y += HALFBAND_COEFFS[j] * (w[mid - 2 * j - 1] + w[mid + 2 * j + 1]);
+		return y;
+	}
+};
+
+
+template <typename T>
+struct HalfBandInterpolator {
+	history::Buffer<T, 32> buffer;
+
+	void reset() {
+		buffer.reset();
+	}
+
+	// One sample in, two out, out[0] first. Delayed by HALFBAND_TAPS - 0.5 input samples
+	void process(T in, T* out) {
+		buffer.push(in);
+		const T* w = buffer.window(2 * HALFBAND_TAPS);
+		T y = 0.f;
+		for (int j = 0; j < HALFBAND_TAPS; j++)
+			y += HALFBAND_COEFFS[j] * (w[HALFBAND_TAPS + j] + w[HALFBAND_TAPS - 1 - j]);
+		out[0] = 2.f * y;
+		out[1] = 2.f * HALFBAND_CENTER * w[HALFBAND_TAPS];
+	}
+};
+
+} // namespace oversample
@@ -14,3 +14,39 @@ extern Model* modelHookeOsc;
 extern Model* modelPSwitch;
 extern Model* modelLogMapOsc;
 extern Model* modelTriliumCV;
+
+// Context menu slider bound to a param, for settings that have no room on the panel
+inline ui::Slider* createParamSlider(Module* module, int paramId) {
+	ui::Slider* slider = new ui::Slider;
+	slider->quantity = module->paramQuantities[paramId];
+	slider->box.size.x = 200.f;
+	return slider;
+}
+
+// Click and drag to paint, for the editors in the context menus.
+// Subclasses set box.size, draw over the background and store each painted point.
+struct PaintWidget : OpaqueWidget {
+	Vec dragPos;
+	
+	virtual void paint(Vec pos) = 0;
+	
+	void draw(const DrawArgs& args) override {
+		nvgBeginPath(args.vg);
+		nvgRect(args.vg, 0, 0, box.size.x, box.size.y);
+		nvgFillColor(args.vg, nvgRGB(0x20, 0x20, 0x20));
+		nvgFill(args.vg);
+	}
+	
+	void onButton(const ButtonEvent& e) override {
+		if (e.action == GLFW_PRESS && e.button == GLFW_MOUSE_BUTTON_LEFT) {
+			e.consume(this);
+			dragPos = e.pos;
+			paint(dragPos);
+		}
+	}
+	
+	void onDragMove(const DragMoveEvent& e) override {
+		dragPos = dragPos.plus(e.mouseDelta.div(getAbsoluteZoom()));
+		paint(dragPos);
+	}
+};
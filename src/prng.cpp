@@ -0,0 +1,35 @@
+#include "prng.hpp"
+
+
+namespace prng {
+
+
+ZigguratTables::ZigguratTables() {
+	// Marsaglia & Tsang, "The Ziggurat Method for Generating Random Variables" (2000)
+	const double m1 = 2147483648.0;
+	const double vn = 9.91256303526217e-3;
+	double dn = 3.442619855899;
+	double tn = dn;
+	double q = vn / std::exp(-0.5 * dn * dn);
+
+	kn[0] = (uint32_t) ((dn / q) * m1);
+	kn[1] = 0;
+	wn[0] = q / m1;
+	wn[127] = dn / m1;
+	fn[0] = 1.f;
+	fn[127] = std::exp(-0.5 * dn * dn);
+
+	for (int i = 126; i >= 1; i--) {
+		dn = std::sqrt(-2.0 * std::log(vn / dn + std::exp(-0.5 * dn * dn)));
+		kn[i + 1] = (uint32_t) ((dn / tn) * m1);
+		tn = dn;
+		fn[i] = std::exp(-0.5 * dn * dn);
+		wn[i] = dn / m1;
+	}
+}
+
+
+const ZigguratTables zigguratTables;
+
+
+} // namespace prng
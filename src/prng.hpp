@@ -0,0 +1,335 @@
+#pragma once
+#include <rack.hpp>
+
+
+using namespace rack;
+
+/* Random deviates for the per-sample paths of the modules.
+
+Every function is templated on a generator, which only has to provide
+`uint32_t u32()`. Normals use the Marsaglia & Tsang ziggurat with 128 layers:
+~98% of the draws cost one integer, one table lookup and one multiply.
+*/
+namespace prng {
+
+/* xoshiro128++ (Blackman & Vigna), one independent stream per module instance.
+The whole state is 4 words so it can be saved with the patch, see Stream.
+*/
+struct Xoshiro128 {
+	uint32_t s[4];
+
+	Xoshiro128() {
+		seed(random::u32());
+	}
+
+	// Expand a seed to the full state with splitmix64, never all zeros
+	void seed(uint64_t x) {
+		for (int i = 0; i < 4; i += 2) {
+			x += 0x9e3779b97f4a7c15ULL;
+			uint64_t z = x;
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+			z ^= z >> 31;
+			s[i] = (uint32_t) z;
+			s[i + 1] = (uint32_t) (z >> 32);
+		}
+	}
+
+	static uint32_t rotl(uint32_t x, int k) {
+		return (x << k) | (x >> (32 - k));
+	}
+
+	uint32_t u32() {
+		uint32_t result = rotl(s[0] + s[3], 7) + s[0];
+		uint32_t t = s[1] << 9;
+		s[2] ^= s[0];
+		s[3] ^= s[1];
+		s[1] ^= s[2];
+		s[0] ^= s[3];
+		s[2] ^= t;
+		s[3] = rotl(s[3], 11);
+		return result;
+	}
+
+	json_t* toJson() {
+		json_t* stateJ = json_array();
+		for (int i = 0; i < 4; i++)
+			json_array_append_new(stateJ, json_integer(s[i]));
+		return stateJ;
+	}
+
+	void fromJson(json_t* stateJ) {
+		if (!stateJ || json_array_size(stateJ) != 4)
+			return;
+		uint32_t state[4];
+		for (int i = 0; i < 4; i++)
+			state[i] = (uint32_t) json_integer_value(json_array_get(stateJ, i));
+		if ((state[0] | state[1] | state[2] | state[3]) == 0)
+			return;
+		std::memcpy(s, state, sizeof(s));
+	}
+};
+
+
+struct ZigguratTables {
+	uint32_t kn[128];
+	float wn[128];
+	float fn[128];
+	ZigguratTables();
+};
+
+// Built once when the plugin is loaded, see prng.cpp
+extern const ZigguratTables zigguratTables;
+
+// Right-most layer boundary
+static const float ZIGGURAT_R = 3.442620f;
+
+
+// Uniform in [0, 1), 24 bits of resolution
+inline float toUniform(uint32_t x) {
+	return (x >> 8) * 5.9604645e-8f;
+}
+
+template <class TGenerator>
+float uniform(TGenerator& g) {
+	return toUniform(g.u32());
+}
+
+// Slow path of the ziggurat, for the base strip and the wedges
+template <class TGenerator>
+float normalFix(TGenerator& g, int32_t hz, uint32_t iz) {
+	const ZigguratTables& t = zigguratTables;
+	for (;;) {
+		float x = hz * t.wn[iz];
+		if (iz == 0) {
+			// Sample from the tail
+			float y;
+			do {
+				x = -std::log(1.f - uniform(g)) / ZIGGURAT_R;
+				y = -std::log(1.f - uniform(g));
+			} while (y + y < x * x);
+			return (hz > 0) ? ZIGGURAT_R + x : -ZIGGURAT_R - x;
+		}
+		if (t.fn[iz] + uniform(g) * (t.fn[iz - 1] - t.fn[iz]) < std::exp(-0.5f * x * x))
+			return x;
+
+		hz = (int32_t) g.u32();
+		iz = hz & 127;
+		uint32_t ahz = (hz < 0) ? -(uint32_t) hz : (uint32_t) hz;
+		if (ahz < t.kn[iz])
+			return hz * t.wn[iz];
+	}
+}
+
+// Standard normal deviate
+template <class TGenerator>
+float normal(TGenerator& g) {
+	const ZigguratTables& t = zigguratTables;
+	int32_t hz = (int32_t) g.u32();
+	uint32_t iz = hz & 127;
+	uint32_t ahz = (hz < 0) ? -(uint32_t) hz : (uint32_t) hz;
+	if (ahz < t.kn[iz])
+		return hz * t.wn[iz];
+	return normalFix(g, hz, iz);
+}
+
+// Block versions, fill `out` with `n` deviates
+template <class TGenerator>
+void fillUniform(TGenerator& g, float* out, int n) {
+	for (int i = 0; i < n; i++)
+		out[i] = toUniform(g.u32());
+}
+
+template <class TGenerator>
+void fillNormal(TGenerator& g, float* out, int n) {
+	const ZigguratTables& t = zigguratTables;
+	for (int i = 0; i < n; i++) {
+		int32_t hz = (int32_t) g.u32();
+		uint32_t iz = hz & 127;
+		uint32_t ahz = (hz < 0) ? -(uint32_t) hz : (uint32_t) hz;
+		out[i] = (ahz < t.kn[iz]) ? hz * t.wn[iz] : normalFix(g, hz, iz);
+	}
+}
+
+
+/* Walker's alias method, with Vose's construction, to draw one of N
+weighted outcomes in O(1). The table is only rebuilt when the weights change.
+*/
+template <int N>
+struct AliasTable {
+	float weights[N];
+	float prob[N];
+	int alias[N];
+	bool valid = false;
+	bool empty = true;
+
+	// Returns true when the table had to be rebuilt
+	bool update(const float* w) {
+		if (valid && std::equal(w, w + N, weights))
+			return false;
+		std::copy(w, w + N, weights);
+		build();
+		return true;
+	}
+
+	void build() {
+		valid = true;
+		float sum = 0.f;
+		for (int i = 0; i < N; i++)
+			sum += std::max(weights[i], 0.f);
+		empty = !(sum > 0.f);
+		if (empty)
+			return;
+
+		float scaled[N];
+		int small[N];
+		int large[N];
+		int numSmall = 0;
+		int numLarge = 0;
+		for (int i = 0; i < N; i++) {
+			scaled[i] = std::max(weights[i], 0.f) * N / sum;
+			if (scaled[i] < 1.f)
+				small[numSmall++] = i;
+			else
+				large[numLarge++] = i;
+		}
+		while (numSmall > 0 && numLarge > 0) {
+			int s = small[--numSmall];
+			int l = large[--numLarge];
+			prob[s] = scaled[s];
+			alias[s] = l;
+			scaled[l] += scaled[s] - 1.f;
+			if (scaled[l] < 1.f)
+				small[numSmall++] = l;
+			else
+				large[numLarge++] = l;
+		}
+		// Left overs are 1 up to rounding
+		while (numLarge > 0) {
+			int l = large[--numLarge];
+			prob[l] = 1.f;
+			alias[l] = l;
+		}
+		while (numSmall > 0) {
+			int s = small[--numSmall];
+			prob[s] = 1.f;
+			alias[s] = s;
+		}
+	}
+
+	// -1 when all the weights are zero
+	template <class TGenerator>
+	int sample(TGenerator& g) const {
+		if (empty)
+			return -1;
+		return sample(uniform(g));
+	}
+
+	// From a uniform in [0, 1), the column and the biased coin share it
+	int sample(float u) const {
+		float x = u * N;
+		int i = std::min((int) x, N - 1);
+		return (x - i < prob[i]) ? i : alias[i];
+	}
+};
+
+
+/* The random stream of a module instance.
+By default every instance draws its own seed, also when it is duplicated or
+loaded from a preset, so that a row of copies stays decorrelated. Once the
+seed is pinned, the seed and the position in the stream are saved with the
+patch, and a render can be reproduced.
+*/
+struct Stream {
+	uint32_t seed;
+	bool pinned = false;
+	Xoshiro128 generator;
+
+	Stream() {
+		seed = random::u32();
+		generator.seed(seed);
+	}
+
+	uint32_t u32() {
+		return generator.u32();
+	}
+
+	void restart() {
+		generator.seed(seed);
+	}
+
+	void pin(uint32_t s) {
+		seed = s;
+		pinned = true;
+		restart();
+	}
+
+	void unpin() {
+		seed = random::u32();
+		pinned = false;
+		restart();
+	}
+
+	// Adds the stream to the module's JSON, only when pinned
+	void toJson(json_t* rootJ) {
+		if (!pinned)
+			return;
+		json_object_set_new(rootJ, "seed", json_integer(seed));
+		json_object_set_new(rootJ, "generator", generator.toJson());
+	}
+
+	void fromJson(json_t* rootJ) {
+		json_t* seedJ = json_object_get(rootJ, "seed");
+		if (!seedJ)
+			return;
+		pin(json_integer_value(seedJ));
+		generator.fromJson(json_object_get(rootJ, "generator"));
+	}
+};
+
+
+/* Context menu entries for a module's random stream.
+Typing a seed (and pressing enter) pins it and restarts the stream from it.
+*/
+struct SeedField : ui::TextField {
+	Stream* stream;
+
+	void onAction(const ActionEvent& e) override {
+		stream->pin((uint32_t) std::strtoul(text.c_str(), NULL, 10));
+		ui::MenuOverlay* overlay = getAncestorOfType<ui::MenuOverlay>();
+		if (overlay)
+			overlay->requestDelete();
+	}
+};
+
+inline void appendSeedMenu(ui::Menu* menu, Stream* stream) {
+	menu->addChild(new ui::MenuSeparator);
+	menu->addChild(createMenuLabel("Random seed"));
+
+	SeedField* field = new SeedField;
+	field->stream = stream;
+	field->text = string::f("%u", stream->seed);
+	field->box.size.x = 100.f;
+	menu->addChild(field);
+
+	menu->addChild(createBoolMenuItem("Pin seed (saved with the patch)", "",
+		[=]() {return stream->pinned;},
+		[=](bool pinned) {
+			if (pinned)
+				stream->pin(stream->seed);
+			else
+				stream->unpin();
+		}
+	));
+	menu->addChild(createMenuItem("Restart from seed", "", [=]() {
+		stream->restart();
+	}));
+	menu->addChild(createMenuItem("New random seed", "", [=]() {
+		if (stream->pinned)
+			stream->pin(random::u32());
+		else
+			stream->unpin();
+	}));
+}
+
+} // namespace prng